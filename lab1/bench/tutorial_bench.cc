@@ -0,0 +1,278 @@
+// Benchmarks for the word index of lab1.
+//
+// Usage: tutorial_bench [options] [corpus file]
+//   --size=<MiB>         size of the generated corpus (64)
+//   --words=<n>          distinct words of the generated corpus (100000)
+//   --skew=<s>           Zipf exponent of the word frequencies (1.0)
+//   --repetitions=<n>    runs per load benchmark, the best is reported (3)
+// Without a corpus file a synthetic corpus with Zipfian word frequencies is
+// generated, as in natural text a few words make up most of the corpus.
+//
+// Build (from lab1):
+//   g++ -std=c++17 -O2 -pthread -Isrc/include src/tutorial/*.cc bench/tutorial_bench.cc -o tutorial_bench
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "tutorial/corpus.h"
+#include "tutorial/trie.h"
+#include "tutorial/tutorial.h"
+
+namespace {
+
+using buzzdb::tutorial::CommandExecutor;
+using buzzdb::tutorial::Trie;
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  size_t size_mib = 64;
+  size_t words = 100000;
+  double skew = 1.0;
+  int repetitions = 3;
+  std::string filename;
+};
+
+/// Writes a corpus of roughly `bytes` bytes. The words are drawn from a
+/// vocabulary of random words, the word of rank r with probability
+/// proportional to 1 / r^skew, and separated by spaces and punctuation.
+std::string make_corpus(const Options& options) {
+  std::string filename = "tutorial_bench_corpus.txt";
+  std::ofstream out(filename);
+  std::mt19937_64 engine{42};
+  std::uniform_int_distribution<int> length_distr{1, 10};
+  std::uniform_int_distribution<int> letter_distr{'a', 'z'};
+  std::vector<std::string> vocabulary(options.words);
+  std::vector<double> weights(options.words);
+  for (size_t rank = 0; rank < options.words; ++rank) {
+    int length = length_distr(engine);
+    for (int j = 0; j < length; ++j) {
+      vocabulary[rank].push_back(static_cast<char>(letter_distr(engine)));
+    }
+    weights[rank] = 1.0 / std::pow(rank + 1.0, options.skew);
+  }
+  std::discrete_distribution<size_t> word_distr(weights.begin(), weights.end());
+  const char* separators[] = {" ", " ", " ", ", ", ".\n", "\n", " -- "};
+  std::uniform_int_distribution<size_t> separator_distr{0, 6};
+  std::string line;
+  size_t bytes = options.size_mib << 20;
+  size_t written = 0;
+  while (written < bytes) {
+    line.clear();
+    for (int i = 0; i < 12; ++i) {
+      line += vocabulary[word_distr(engine)];
+      line += separators[separator_distr(engine)];
+    }
+    out << line;
+    written += line.size();
+  }
+  return filename;
+}
+
+/// Peak resident set size of the process in MiB. It is a high water mark,
+/// so it only grows over the phases of the benchmark.
+double peak_rss_mib() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;
+}
+
+/// Current resident set size of the process in MiB.
+double current_rss_mib() {
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0;
+  size_t resident = 0;
+  statm >> pages >> resident;
+  return resident * static_cast<double>(sysconf(_SC_PAGESIZE)) / (1 << 20);
+}
+
+double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/// The loader before the corpus was mapped: getline, rewrite every char
+/// through `validLettersAndSymbols` and tokenize with an `istringstream`.
+void load_getline(const std::string& filename, Trie& trie) {
+  std::ifstream input(filename);
+  std::string line;
+  int index = 1;
+  while (std::getline(input, line)) {
+    for (char& c : line) {
+      if (buzzdb::tutorial::validLettersAndSymbols.find(c) == std::string::npos) c = ' ';
+      if (isupper(c)) c = tolower(c);
+    }
+    std::istringstream iss(line);
+    std::string word;
+    while (iss >> word) {
+      trie.insert_with_loc(word, index++);
+    }
+  }
+}
+
+/// Runs `load` `repetitions` times on a fresh trie and prints the best MB/s.
+void bench_load(const char* name, const std::function<void(Trie&)>& load,
+                size_t file_size, int repetitions) {
+  double best = 0;
+  for (int i = 0; i < repetitions; ++i) {
+    Trie trie;
+    auto start = Clock::now();
+    load(trie);
+    double seconds = seconds_since(start);
+    best = std::max(best, file_size / seconds / (1 << 20));
+  }
+  std::printf("%-10s %10.1f MB/s\n", name, best);
+}
+
+/// Picks `count` locate queries for words of the corpus.
+std::vector<std::pair<std::string, int>> make_queries(const std::string& filename,
+                                                      size_t count) {
+  buzzdb::tutorial::MappedFile file(filename);
+  std::vector<std::pair<std::string, int>> queries;
+  size_t word = 0;
+  buzzdb::tutorial::for_each_word(
+      file.data(), file.data() + file.size(), [&](std::string_view view) {
+        if (queries.size() < count && word++ % 7 == 0) {
+          queries.emplace_back(std::string(view), 1 + static_cast<int>(word % 3));
+        }
+      });
+  return queries;
+}
+
+/// Compares locate queries through `execute` with a single `locate_batch`.
+void bench_locate(const std::string& filename, size_t count) {
+  CommandExecutor executor;
+  executor.execute("load " + filename);
+  auto queries = make_queries(filename, count);
+  std::vector<std::string> commands;
+  std::string batch;
+  for (auto& [word, occurrence] : queries) {
+    commands.push_back("locate " + word + " " + std::to_string(occurrence));
+    batch += word + " " + std::to_string(occurrence) + "\n";
+  }
+  auto start = Clock::now();
+  size_t matches = 0;
+  for (auto& command : commands) {
+    matches += executor.execute(command)[0] != 'N';
+  }
+  double single = seconds_since(start);
+  start = Clock::now();
+  std::string result;
+  executor.locate_batch(batch, result);
+  double batched = seconds_since(start);
+  std::printf("%-10s %10.2f Mqueries/s (%zu matches)\n", "execute",
+              queries.size() / single / 1e6, matches);
+  std::printf("%-10s %10.2f Mqueries/s\n", "batch", queries.size() / batched / 1e6);
+}
+
+/// Measures a whole session of `CommandExecutor`: the load command with the
+/// memory it takes, the latency of single locate commands and the time the
+/// new command takes to release the trie.
+void bench_executor(const std::string& filename, size_t count) {
+  auto queries = make_queries(filename, count);
+  std::vector<std::string> commands;
+  for (auto& [word, occurrence] : queries) {
+    commands.push_back("locate " + word + " " + std::to_string(occurrence));
+  }
+  double rss_before = current_rss_mib();
+  CommandExecutor executor;
+  auto start = Clock::now();
+  executor.execute("load " + filename);
+  double load = seconds_since(start);
+  std::printf("%-10s %10.3f s, trie %.1f MiB resident, peak RSS %.1f MiB\n", "load", load,
+              current_rss_mib() - rss_before, peak_rss_mib());
+
+  std::vector<double> latencies;
+  latencies.reserve(commands.size());
+  for (auto& command : commands) {
+    auto query = Clock::now();
+    executor.execute(command);
+    latencies.push_back(std::chrono::duration<double, std::nano>(Clock::now() - query).count());
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+  };
+  std::printf("%-10s p50 %.0f ns, p90 %.0f ns, p99 %.0f ns, p99.9 %.0f ns, max %.0f ns\n", "locate",
+              percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999),
+              latencies.back());
+
+  start = Clock::now();
+  executor.execute("new");
+  std::printf("%-10s %10.3f s\n", "teardown", seconds_since(start));
+}
+
+/// Parses `--name=value` options, the first other argument is the corpus file.
+bool parse_options(int argc, char* argv[], Options& options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg.substr(0, 2) != "--") {
+      options.filename = argv[i];
+      continue;
+    }
+    size_t equals = arg.find('=');
+    if (equals == std::string_view::npos) return false;
+    std::string_view name = arg.substr(2, equals - 2);
+    std::string value(arg.substr(equals + 1));
+    if (name == "size") options.size_mib = std::stoul(value);
+    else if (name == "words") options.words = std::max<size_t>(std::stoul(value), 1);
+    else if (name == "skew") options.skew = std::stod(value);
+    else if (name == "repetitions") options.repetitions = std::max(std::stoi(value), 1);
+    else return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    std::fprintf(stderr, "usage: %s [--size=MiB] [--words=n] [--skew=s] [--repetitions=n] [corpus file]\n",
+                 argv[0]);
+    return 1;
+  }
+  bool generated = options.filename.empty();
+  std::string filename = generated ? make_corpus(options) : options.filename;
+  int repetitions = options.repetitions;
+  size_t file_size = buzzdb::tutorial::MappedFile(filename).size();
+  if (generated) {
+    std::printf("corpus %s, %.1f MiB, %zu words, skew %.2f\n", filename.c_str(),
+                file_size / double(1 << 20), options.words, options.skew);
+  } else {
+    std::printf("corpus %s, %.1f MiB\n", filename.c_str(), file_size / double(1 << 20));
+  }
+
+  bench_executor(filename, 1 << 20);
+
+  bench_load("getline", [&](Trie& trie) { load_getline(filename, trie); },
+             file_size, repetitions);
+  bench_load("streamed",
+             [&](Trie& trie) { buzzdb::tutorial::load_file_streamed(filename, trie); },
+             file_size, repetitions);
+  bench_load("mapped",
+             [&](Trie& trie) { buzzdb::tutorial::load_file(filename, trie, 1); },
+             file_size, repetitions);
+  unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+  std::printf("parallel load with %u threads\n", threads);
+  bench_load("parallel",
+             [&](Trie& trie) { buzzdb::tutorial::load_file(filename, trie, threads); },
+             file_size, repetitions);
+
+  bench_locate(filename, 1 << 20);
+
+  if (generated) std::remove(filename.c_str());
+  return 0;
+}
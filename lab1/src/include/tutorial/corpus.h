@@ -0,0 +1,114 @@
+/*******************************************************
+ * File: corpus.h
+ * Author: Bo Pang
+ * GT ID: 903924447
+ * Email: bpang42@gatech.edu
+ *
+ * Description:
+ * This file contains the implementation of CS6422 Assignment1;
+ * Header file of the corpus loader.
+ *******************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "tutorial/trie.h"
+
+using namespace std;
+namespace buzzdb {
+namespace tutorial {
+
+// Read only mapping of a whole file, released in the destructor.
+class MappedFile {
+public:
+    // Input: sequential: the file is read front to back once, otherwise it
+    // is accessed randomly and should be kept in the page cache.
+    explicit MappedFile(const string &filename, bool sequential = true);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // The file could be opened.
+    bool is_open() const {return fd >= 0;}
+    // The file could be mapped, false for pipes and other special files.
+    bool is_mapped() const {return mapped;}
+
+    const char* data() const {return addr;}
+    size_t size() const {return length;}
+
+private:
+    int fd;
+    bool mapped;
+    const char* addr;
+    size_t length;
+};
+
+// How far a file has been loaded, so words appended to the file later can be
+// loaded without reading it again.
+struct LoadState {
+    uint64_t bytes = 0;     // bytes of the file that are loaded
+    int next_index = 1;     // index of the next word of the file
+    // The loaded word at the end of the file that no separator follows yet
+    // starts at tail_start and has index tail_index. It may still grow, so
+    // the next append loads it again. tail_start is bytes if there is none.
+    uint64_t tail_start = 0;
+    int tail_index = 0;
+
+    bool has_tail() const {return tail_start < bytes;}
+    // Index of the first word the next append loads.
+    int append_index() const {return has_tail() ? tail_index : next_index;}
+};
+
+// Call f(word) for every word in [begin, end). A word is a maximal run of
+// bytes with a valid symbol_index, the views point right into the input.
+template <typename F>
+void for_each_word(const char* begin, const char* end, F &&f) {
+    const char* p = begin;
+    while(p < end){
+        while(p < end && symbol_index(*p) < 0) p++;
+        const char* start = p;
+        while(p < end && symbol_index(*p) >= 0) p++;
+        if(p > start) f(string_view(start, p - start));
+    }
+}
+
+// Insert every word of [begin, end) with a running index;
+// Input: index: the index of the first word. Output: the index of the next word.
+int insert_words(Trie &trie, const char* begin, const char* end, int index);
+
+// Insert every word of [begin, end) into the empty trie with several threads.
+// The input is cut into one chunk per thread on word boundaries, the chunks
+// are tokenized and counted in parallel, which gives every chunk the global
+// index of its first word, and the words are then inserted into one shard per
+// first symbol concurrently. The shards are merged into the trie at the end;
+// Input: index: the index of the first word. Output: the index of the next word.
+int insert_words_parallel(Trie &trie, const char* begin, const char* end, int index, unsigned threads);
+
+// Load a file into the trie, the file is mapped if possible and read block by
+// block otherwise. Large mapped files are loaded by `threads` threads. The end
+// of the file ends the last word. If tail is given, a last word that no
+// separator follows goes into tail instead of trie, so that an append which
+// finds it grown can drop it;
+// Output: false if the file can not be opened. state: where a later append_file starts, if given.
+bool load_file(const string &filename, Trie &trie, unsigned threads = thread::hardware_concurrency(),
+               LoadState *state = nullptr, Trie *tail = nullptr);
+
+// Load a file into the trie by reading it block by block, see load_file;
+// Output: false if the file can not be opened or read. state: where a later append_file starts, if given.
+bool load_file_streamed(const string &filename, Trie &trie, LoadState *state = nullptr, Trie *tail = nullptr);
+
+// Load the words appended to a file since it was loaded with state into trie.
+// A tail of state is loaded again with its index, grown or not, the caller
+// drops the tail trie it was loaded into. The new last word goes into tail
+// like in load_file. A file that became shorter than state was truncated or
+// replaced, trie and tail are loaded from scratch then;
+// Output: false if the file can not be opened or mapped.
+bool append_file(const string &filename, Trie &trie, LoadState &state, Trie *tail = nullptr);
+
+}  // namespace tutorial
+}  // namespace buzzdb
@@ -3,7 +3,7 @@
  * Author: Bo Pang
  * GT ID: 903924447
  * Email: bpang42@gatech.edu
- * 
+ *
  * Description:
  * This file contains the implementation of CS6422 Assignment1;
  * Header file of trie.
@@ -11,42 +11,236 @@
 
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
 using namespace std;
 namespace buzzdb {
 namespace tutorial {
-class Node{
-public:
-    Node();
-    vector<Node*> letter_vec;//用来指向26个字母。
-    //每一个Node对应了一个word
-    vector<int> location;//用来记录这个word的index-location关系
-    bool end;
+
+// Number of symbols a word can contain: a-z, 0-9 and '.
+constexpr int kAlphabetSize = 37;
+// Node id 0 is always the root, so it never shows up as a child.
+constexpr uint32_t kNoNode = 0;
+constexpr uint32_t kNoPosting = UINT32_MAX;
+constexpr uint32_t kNoDirectory = UINT32_MAX;
+// Locations start at 1, 0 marks a query without a match.
+constexpr uint32_t kNoLocation = 0;
+
+// Child slot of every byte (a-z: 0-25, 0-9: 26-35, ': 36), -1 if the byte
+// can not be part of a word. Upper case letters map to lower case.
+extern const array<int8_t, 256> kSymbolIndex;
+
+inline int symbol_index(char c) {return kSymbolIndex[static_cast<unsigned char>(c)];}
+
+// Every Node lives in the node arena of its Trie and is referenced by id.
+// Children are bitmap indexed: bit i of child_mask is set when the node has a
+// child for symbol i, the child ids are stored densely in symbol order in the
+// child pool starting at `children`.
+struct Node {
+    uint64_t child_mask;
+    uint32_t children;
+    uint32_t posting;   // index into the posting lists, kNoPosting if no word ends here.
+};
+
+// Locations of one word, compressed into a chain of chunks in the location
+// pool. Every chunk is twice as large as the one before (up to 64 KiB). A
+// list with more than one chunk keeps a directory of its chunks in the pool
+// as well, [capacity][used][chunk ...], so the chunk of the Nth location is
+// found by a binary search over the first ordinals of the chunks.
+//
+// Chunk layout: [next][size][first ordinal][used][deltas ...  skips]
+// The locations are stored as varint deltas that grow from the front. Every
+// kSkipInterval-th location of a chunk is kept as a skip entry instead,
+// (location, offset of the following delta), and the skip entries grow from
+// the back. A lookup jumps to the closest skip entry and decodes at most
+// kSkipInterval - 1 deltas. Locations must be appended in ascending order.
+struct PostingList {
+    uint32_t count;
+    uint32_t head;      // first chunk
+    uint32_t tail;      // chunk that is currently filled
+    uint32_t last;      // last location, the base of the next delta
+    uint32_t directory; // of the chunks, kNoDirectory while there is one chunk
+};
+
+// Called by the scans for every word found with its number of occurrences.
+// Returning false stops the scan.
+using WordVisitor = function<bool(string_view word, uint32_t count)>;
+
+// Patterns of scan_pattern may not be longer, the matcher keeps one bit per
+// pattern position.
+constexpr size_t kMaxPattern = 63;
+
+// One query of a batch: the location of the nth (1 based) occurrence of word.
+struct LocateQuery {
+    string_view word;
+    uint32_t occurrence;
 };
 
 class Trie {
 public:
     /** Initialize your data structure here. */
-    Node* root;
     Trie();
-    
-    ~Trie();
-    void ReleaseMemory(Node* &ptr);
+
+    // A Trie is moved, never copied, the view points into its own arenas.
+    Trie(const Trie&) = delete;
+    Trie& operator=(const Trie&) = delete;
+    Trie(Trie&&) = default;
+    Trie& operator=(Trie&&) = default;
+
+    // Copy the arenas into a new trie, explicit so no copy happens by accident.
+    // A mapped snapshot is shared, it is only read.
+    Trie clone() const;
+
+    // Release all nodes and locations by dropping the arenas, no per node work.
+    void clear();
 
     /** Inserts a word into the trie. */
-    void insert(string word);
-    
+    void insert(string_view word);
+
     /** Returns if the word is in the trie. */
-    bool  search(string word);
-    
+    bool search(string_view word) const;
+
     /** Returns if there is any word in the trie that starts with the given prefix. */
-    bool startsWith(string prefix);
+    bool startsWith(string_view prefix) const;
+
+    void insert_with_loc(string_view word, int index);
+
+    void search_with_loc(string_view word, int index, string &result) const;
+
+    // Answer a batch of queries. The queries are visited in sorted order, so
+    // a query only walks down from the longest prefix it shares with the one
+    // before, and queries for the same word share the walk completely;
+    // Output: results[i] is the location for queries[i] or kNoLocation.
+    // counts[i], if given, is the number of locations of queries[i].word.
+    void locate_batch(const LocateQuery* queries, size_t count, uint32_t* results,
+                      uint32_t* counts = nullptr) const;
+
+    // Number of locations of word, 0 if it is not in the trie.
+    uint32_t count(string_view word) const;
+
+    // The scans visit words in lexicographic order (' < 0-9 < a-z). They walk
+    // the trie with an explicit stack that is reused by the thread, so a scan
+    // does not allocate, and stop as soon as the visitor returns false.
+
+    // Visit all words that start with prefix.
+    void scan_prefix(string_view prefix, const WordVisitor &visit) const;
+
+    // Visit all words matching pattern: '?' matches one symbol, '*' any
+    // number of symbols. Patterns longer than kMaxPattern match nothing.
+    void scan_pattern(string_view pattern, const WordVisitor &visit) const;
+
+    // Visit all words w with from <= w <= to.
+    void scan_range(string_view from, string_view to, const WordVisitor &visit) const;
+
+    // Move shards into this empty trie. Shard s may only hold words that
+    // start with symbol s, so every shard is a disjoint subtree of the root
+    // and only needs to be relocated into the arenas. The shards are
+    // relocated by up to `threads` threads and are empty afterwards.
+    void merge_shards(vector<Trie> &shards, unsigned threads);
+
+    // Insert every word of other with all its locations. The locations of
+    // other must be larger than every location in this trie.
+    void append_trie(const Trie &other);
+
+    // Write the trie to a snapshot file. The arenas are written as they are,
+    // every reference inside them is an index, so the file does not depend
+    // on where it is mapped;
+    // Output: false if the file can not be written.
+    bool save(const string &filename) const;
+
+    // Replace the trie with a snapshot written by save(). The snapshot is
+    // mapped and queried in place, nothing is deserialized. The first insert
+    // copies the snapshot into the arenas;
+    // Output: false if the file can not be opened or is not a snapshot.
+    bool open(const string &filename);
+
+    // Bytes held by the arenas.
+    size_t memory_usage() const;
+
+private:
+    // Child blocks are handed out in a few capacity classes so that most
+    // inserts of a new child do not need to move the block.
+    static constexpr int kCapClasses = 6;
+    static constexpr uint32_t kCapacity[kCapClasses] = {1, 2, 4, 8, 16, kAlphabetSize};
+    static constexpr uint32_t kNoBlock = UINT32_MAX;
+    static constexpr uint32_t kChunkHeader = 16;
+    static constexpr uint32_t kFirstChunk = 32;
+    static constexpr uint32_t kMaxChunk = 64 << 10;
+    static constexpr uint32_t kSkipInterval = 64;
+    static constexpr uint32_t kFirstDirectory = 8;
+
+    // Read only view of the arenas, all queries go through it. It points to
+    // the vectors, or into the snapshot mapped by open().
+    struct View {
+        const Node* nodes;
+        const uint32_t* child_pool;
+        const PostingList* postings;
+        const uint8_t* location_pool;
+        size_t node_count;
+        size_t child_count;
+        size_t posting_count;
+        size_t location_count;
+    };
+
+    // A node on the stack of a scan.
+    struct ScanFrame {
+        uint32_t node;
+        uint64_t pending;   // children still to visit, as ranks (see ordered_children)
+        uint64_t state;     // pattern positions that are alive at this node
+    };
+
+    // Walk the frames on the stack in pre order. step(slot, state) is asked
+    // for every child: it returns false to skip the child, and otherwise
+    // turns the state of the parent into the state of the child. A word is
+    // visited when accept(state) holds.
+    template <typename Step, typename Accept>
+    void walk(vector<ScanFrame> &stack, string &word, Step &&step, Accept &&accept,
+              const WordVisitor &visit) const;
+    uint32_t count_of(uint32_t node) const;
+
+    // Point the view to the vectors after they changed.
+    void sync_view();
+    // Copy a mapped snapshot into the vectors before it is changed.
+    void thaw();
+
+    static uint32_t child(const Node* nodes, const uint32_t* child_pool, uint32_t node, int symbol);
+    uint32_t add_child(uint32_t node, int symbol);
+    uint32_t alloc_children(int cap_class);
+    void free_children(uint32_t block, int cap_class);
+    static int cap_class(uint32_t size);
+
+    // Walk down the trie, return kNoNode if the path does not exist.
+    uint32_t find(string_view word) const;
+    // Walk down the trie and create the missing nodes.
+    uint32_t find_or_create(string_view word);
+    uint32_t new_posting();
+    void append_location(PostingList &list, uint32_t location);
+    // Add a new chunk to the directory of a list, grow the directory if it is full.
+    void add_to_directory(PostingList &list, uint32_t chunk);
+    // Get the nth (0 based) location of a list, n must be below the count.
+    static uint32_t nth_location(const uint8_t* pool, const PostingList &list, uint32_t n);
+    // Call f(location) for every location of a list, in order.
+    template <typename F>
+    static void for_each_location(const uint8_t* pool, const PostingList &list, F &&f);
 
-    void insert_with_loc(string word, int index);
+    vector<Node> nodes;
+    vector<uint32_t> child_pool;
+    // Head of the free list of every capacity class, the next free block is
+    // stored in the first slot of a free block.
+    uint32_t free_blocks[kCapClasses];
+    vector<PostingList> postings;
+    vector<uint8_t> location_pool;
 
-    void search_with_loc(string word, int index,string &result);
+    View view;
+    // Keeps the mapping of an opened snapshot alive.
+    shared_ptr<const void> snapshot;
 };
 }
 }
@@ -12,29 +12,116 @@
 
 #pragma once    // Avoid multiple times of include header file.
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
-#include "tutorial/trie.h"
+#include <string_view>
+#include <vector>
+#include "tutorial/corpus.h"
 
 using namespace std;
 
 namespace buzzdb {
 namespace tutorial {
 
+// Number of threads that can query one executor at the same time without
+// waiting for a free reader slot.
+constexpr size_t kReaderSlots = 64;
+
+// A published state of the index. The words of a file are kept in layers:
+// load builds the first one, every append adds a layer with only the words
+// it loaded, and the last layer is merged into the one before it while it
+// holds at least half as many words. An append copies no more than the
+// layers it merges, so every word is copied O(log n) times over all
+// appends, and a query looks at O(log n) layers. Published layers are never
+// changed, the versions that follow share them. A last word of the file that
+// no separator follows yet is kept in a layer of its own at the end, which is
+// never merged: the next append drops it and loads the word again.
+struct IndexVersion {
+  struct Layer {
+    std::shared_ptr<const Trie> trie;
+    uint64_t words;     // locations in the layer
+  };
+  std::vector<Layer> layers;
+  bool tail = false;    // the last layer is the tail word
+};
+
+// The executor can be used from several threads at once. Queries pin the
+// current version and never wait, commands that replace the version build
+// the new one first and then publish it; the old version is freed once no
+// query that could still see it is running.
 class CommandExecutor {
  public:
   CommandExecutor();
   ~CommandExecutor();
 
-  Trie* current_db;
+  // The published version, replaced by publish only.
+  std::atomic<IndexVersion*> current_db;
+  // The file current_db was loaded from and how far, empty if it was not loaded from a file.
+  std::string loaded_file;
+  LoadState load_state;
 
   std::string execute(std::string);
+
+  // Answer many locate queries at once. `queries` holds one "word occurrence"
+  // pair per line. The answers are appended to `result`, one line per query
+  // in the format of execute, in the order of the queries.
+  void locate_batch(std::string_view queries, std::string &result);
   void handle_load(vector<string> com_vec,string &result);
+  void handle_append(vector<string> com_vec,string &result);
   void handle_locate(vector<string> com_vec,string &result);
   void handle_new(vector<string> com_vec,string &result);
   void handle_end(vector<string> com_vec,string &result);
+  void handle_save(vector<string> com_vec,string &result);
+  void handle_open(vector<string> com_vec,string &result);
+  void handle_prefix(vector<string> com_vec,string &result);
+  void handle_match(vector<string> com_vec,string &result);
+  void handle_range(vector<string> com_vec,string &result);
+
+ private:
+  // Epoch a reader pinned, 0 if the slot is free. Each slot has its own cache line.
+  struct alignas(64) ReaderSlot {
+    std::atomic<uint64_t> epoch{0};
+  };
+
+  // Take a free slot and record the current epoch, current_db can be
+  // loaded and used until the slot is released;
+  // Output: the slot to pass to unpin_reader.
+  size_t pin_reader();
+  void unpin_reader(size_t slot);
+
+  // Holds a reader slot for as long as it lives, so a query that throws
+  // can not leave its slot pinned and block the next publish forever.
+  class ReaderPin {
+   public:
+    explicit ReaderPin(CommandExecutor &executor, bool active = true)
+        : executor(executor), slot(active ? executor.pin_reader() : kReaderSlots) {}
+    ~ReaderPin() {
+      if (slot != kReaderSlots) executor.unpin_reader(slot);
+    }
+    ReaderPin(const ReaderPin&) = delete;
+    ReaderPin& operator=(const ReaderPin&) = delete;
+
+   private:
+    CommandExecutor &executor;
+    size_t slot;    // kReaderSlots if nothing is pinned
+  };
+
+  // Publish version as current_db and free the old version once all readers
+  // pinned before the swap are gone. Only called with writer held.
+  void publish(IndexVersion* version);
+
+  ReaderSlot readers[kReaderSlots];
+  std::atomic<uint64_t> epoch;
+  // Serializes the commands that replace current_db.
+  std::mutex writer;
 };
 
-enum Com_Type{LOAD, LOCATE, NEW, END, BAD};
+enum Com_Type{LOAD, APPEND, LOCATE, NEW, END, SAVE, OPEN, PREFIX, MATCH, RANGE, BAD};
+
+// Number of words the prefix, match and range commands list without a limit.
+constexpr size_t kDefaultScanLimit = 100;
 
 vector<string> fetch_word(string com, Com_Type &com_type);
 
@@ -0,0 +1,237 @@
+/*******************************************************
+ * File: corpus.cc
+ * Author: Bo Pang
+ * GT ID: 903924447
+ * Email: bpang42@gatech.edu
+ *
+ * Description:
+ * This file contains the implementation of CS6422 Assignment1;
+ * Impliment the corpus loader;
+ *******************************************************/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "tutorial/corpus.h"
+
+
+using namespace std;
+namespace buzzdb {
+namespace tutorial {
+
+// Block size of the streamed loader.
+static constexpr size_t kReadBlock = 1 << 20;
+// Files below this size are not worth to be loaded in parallel.
+static constexpr size_t kParallelLoad = 8 << 20;
+// Bytes every thread tokenizes per round of the parallel loader. The rounds
+// bound the memory of the buffered word references.
+static constexpr size_t kRoundBytes = 32 << 20;
+
+// Word offsets within a round are 32 bit.
+static constexpr size_t kMaxRound = size_t(1) << 31;
+
+// A word of a chunk, buffered until its shard is built.
+struct WordRef {
+    uint32_t offset;        // offset from the start of the round
+    uint32_t length;
+    uint32_t local_index;   // index of the word within its chunk
+};
+
+// Run f(thread_id) on `threads` threads, the calling thread is one of them;
+template <typename F>
+static void run_parallel(unsigned threads, F &&f){
+    vector<thread> workers;
+    for(unsigned t = 1; t < threads; t++) workers.emplace_back(f, t);
+    f(0u);
+    for(thread &worker : workers) worker.join();
+}
+
+// Open and map the file. A corpus is read front to back exactly once, so
+// the kernel reads ahead aggressively, other files are prefetched as a whole;
+MappedFile::MappedFile(const string &filename, bool sequential): fd(-1), mapped(false), addr(nullptr), length(0) {
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return;
+    struct ::stat file_stat;
+    if(::fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) return;
+    length = static_cast<size_t>(file_stat.st_size);
+    if(length == 0){
+        // mmap does not accept empty mappings
+        mapped = true;
+        return;
+    }
+    void* ptr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(ptr == MAP_FAILED){
+        length = 0;
+        return;
+    }
+    ::madvise(ptr, length, sequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+    addr = static_cast<const char*>(ptr);
+    mapped = true;
+}
+
+MappedFile::~MappedFile(){
+    if(addr) ::munmap(const_cast<char*>(addr), length);
+    if(fd >= 0) ::close(fd);
+}
+
+// Insert every word of [begin, end) with a running index;
+// Input: index: the index of the first word. Output: the index of the next word.
+int insert_words(Trie &trie, const char* begin, const char* end, int index){
+    for_each_word(begin, end, [&](string_view word){
+        trie.insert_with_loc(word, index);    //index is the index of the current word in the file.
+        index++;
+    });
+    return index;
+}
+
+// Insert every word of [begin, end) into the empty trie with several threads;
+// Input: index: the index of the first word. Output: the index of the next word.
+int insert_words_parallel(Trie &trie, const char* begin, const char* end, int index, unsigned threads){
+    threads = max(threads, 1u);
+    vector<Trie> shards(kAlphabetSize);
+    vector<array<vector<WordRef>, kAlphabetSize>> buckets(threads);
+    vector<const char*> bounds(threads + 1);
+    vector<int> first_index(threads + 1);
+    for(const char* round = begin; round < end; round = bounds[threads]){
+        // Cut the round into chunks, a word on a cut belongs to the chunk on the left;
+        size_t round_size = min(static_cast<size_t>(end - round), min(kRoundBytes * threads, kMaxRound));
+        bounds[0] = round;
+        for(unsigned t = 1; t <= threads; t++){
+            const char* cut = max(bounds[t - 1], round + round_size * t / threads);
+            while(cut < end && symbol_index(*cut) >= 0) cut++;
+            bounds[t] = cut;
+        }
+        // Tokenize and count the chunks;
+        run_parallel(threads, [&](unsigned t){
+            uint32_t count = 0;
+            for(vector<WordRef> &bucket : buckets[t]) bucket.clear();
+            for_each_word(bounds[t], bounds[t + 1], [&](string_view word){
+                buckets[t][symbol_index(word[0])].push_back(
+                    {static_cast<uint32_t>(word.data() - round), static_cast<uint32_t>(word.size()), count++});
+            });
+            first_index[t + 1] = static_cast<int>(count);
+        });
+        first_index[0] = index;
+        for(unsigned t = 1; t <= threads; t++) first_index[t] += first_index[t - 1];
+        // Build the shards, the largest first so no thread is left with a big one at the end;
+        array<size_t, kAlphabetSize> order;
+        array<size_t, kAlphabetSize> words{};
+        for(size_t s = 0; s < kAlphabetSize; s++){
+            order[s] = s;
+            for(unsigned t = 0; t < threads; t++) words[s] += buckets[t][s].size();
+        }
+        sort(order.begin(), order.end(), [&](size_t a, size_t b){return words[a] > words[b];});
+        atomic<size_t> next_shard{0};
+        run_parallel(threads, [&](unsigned){
+            for(size_t i = next_shard++; i < kAlphabetSize && words[order[i]] > 0; i = next_shard++){
+                size_t s = order[i];
+                for(unsigned t = 0; t < threads; t++){
+                    for(const WordRef &ref : buckets[t][s]){
+                        shards[s].insert_with_loc(string_view(round + ref.offset, ref.length),
+                                                  first_index[t] + static_cast<int>(ref.local_index));
+                    }
+                }
+            }
+        });
+        index = first_index[threads];
+    }
+    trie.merge_shards(shards, threads);
+    return index;
+}
+
+// Insert the last word of a file and record where the next append starts.
+// The word goes into tail if given and is loaded again by the next append;
+// Input: [begin, end): the last word, empty if the file ends with a separator. index: its index. start: its offset;
+static void finish_load(Trie &trie, Trie *tail, const char* begin, const char* end, int index, uint64_t start,
+                        LoadState *state){
+    bool partial = begin < end;
+    if(partial) (tail ? *tail : trie).insert_with_loc(string_view(begin, end - begin), index);
+    uint64_t bytes = start + static_cast<uint64_t>(end - begin);
+    if(state) *state = {bytes, index + partial, (tail && partial) ? start : bytes, index};
+}
+
+// Load a file into the trie;
+// Input: filename: the file to load. trie: an empty trie. threads: number of threads for large files;
+bool load_file(const string &filename, Trie &trie, unsigned threads, LoadState *state, Trie *tail){
+    MappedFile file(filename);
+    if(!file.is_open()) return false;
+    if(!file.is_mapped()) return load_file_streamed(filename, trie, state, tail);
+    // The last word is inserted on its own, it may have no separator;
+    const char* end = file.data() + file.size();
+    const char* cut = end;
+    while(cut > file.data() && symbol_index(cut[-1]) >= 0) cut--;
+    int index;
+    if(threads > 1 && file.size() >= kParallelLoad){
+        index = insert_words_parallel(trie, file.data(), cut, 1, threads);
+    }
+    else{
+        index = insert_words(trie, file.data(), cut, 1);
+    }
+    finish_load(trie, tail, cut, end, index, static_cast<uint64_t>(cut - file.data()), state);
+    return true;
+}
+
+// Load the words appended to a file since the state was taken;
+// Input: filename: the file to load. trie: gets the new words. state: updated to the new end;
+bool append_file(const string &filename, Trie &trie, LoadState &state, Trie *tail){
+    MappedFile file(filename);
+    if(!file.is_open() || !file.is_mapped()) return false;
+    if(file.size() < state.bytes){
+        trie.clear();
+        if(tail) tail->clear();
+        return load_file(filename, trie, thread::hardware_concurrency(), &state, tail);
+    }
+    // The tail may have grown, it is loaded again from its start;
+    const char* begin = file.data() + state.tail_start;
+    const char* end = file.data() + file.size();
+    const char* cut = end;
+    while(cut > begin && symbol_index(cut[-1]) >= 0) cut--;
+    int index = insert_words(trie, begin, cut, state.append_index());
+    finish_load(trie, tail, cut, end, index, static_cast<uint64_t>(cut - file.data()), &state);
+    return true;
+}
+
+// Load a file into the trie by reading it block by block. A word that is cut
+// at the end of a block is moved to the front and finished with the next block;
+// Input: filename: the file to load. trie: an empty trie;
+bool load_file_streamed(const string &filename, Trie &trie, LoadState *state, Trie *tail){
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    vector<char> buffer(kReadBlock);
+    size_t filled = 0;
+    uint64_t total = 0;
+    int index = 1;
+    while(true){
+        if(filled == buffer.size()) buffer.resize(buffer.size() * 2);   // a single word is longer than the buffer
+        ssize_t bytes_read = ::read(fd, buffer.data() + filled, buffer.size() - filled);
+        if(bytes_read < 0){
+            if(errno == EINTR) continue;
+            // A load that stops early is not a load;
+            ::close(fd);
+            return false;
+        }
+        if(bytes_read == 0) break;
+        filled += static_cast<size_t>(bytes_read);
+        total += static_cast<uint64_t>(bytes_read);
+        // Only words followed by a separator are complete;
+        size_t cut = filled;
+        while(cut > 0 && symbol_index(buffer[cut - 1]) >= 0) cut--;
+        index = insert_words(trie, buffer.data(), buffer.data() + cut, index);
+        copy(buffer.begin() + cut, buffer.begin() + filled, buffer.begin());
+        filled -= cut;
+    }
+    ::close(fd);
+    // What is left is the last word, the end of the file ends it;
+    finish_load(trie, tail, buffer.data(), buffer.data() + filled, index, total - filled, state);
+    return true;
+}
+
+}  // namespace tutorial
+}  // namespace buzzdb
@@ -3,14 +3,22 @@
  * Author: Bo Pang
  * GT ID: 903924447
  * Email: bpang42@gatech.edu
- * 
+ *
  * Description:
  * This file contains the implementation of CS6422 Assignment1;
  * Impliment the Trie structure;
  *******************************************************/
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <thread>
 #include <vector>
+#include "tutorial/corpus.h"
 #include "tutorial/trie.h"
 
 
@@ -18,125 +26,768 @@ using namespace std;
 namespace buzzdb {
 namespace tutorial {
 
-// Constructor for Node;
-Node::Node(): letter_vec(37,NULL), location({}),end(false) {}
-    
-// Constructor for Trie;
-Trie::Trie() {root = new Node;}
-
-// Use new in the constructor, so need destructor;
-Trie::~Trie() {ReleaseMemory(root);}
-
-// Release the memory for Trie;
-// Input: ptr: pointer to the memory to deallocate;
-void Trie::ReleaseMemory(Node* &ptr){//use reference to set the deleted pointer to nullptr!!;
-    if(ptr == NULL) return;
-    //cout<< "ReleaseMemory" <<endl;
-    for(Node* i : ptr->letter_vec){
-        if(i) ReleaseMemory(i);
-    }
-    delete(ptr);
-    ptr = nullptr;
-    return;
+// Build the lookup table for symbol_index;
+static constexpr array<int8_t, 256> make_symbol_index(){
+    array<int8_t, 256> table{};
+    for(int c = 0; c < 256; c++){
+        if(c>='a' && c<='z') table[c] = c - 'a';
+        else if(c>='A' && c<='Z') table[c] = c - 'A';
+        else if(c>='0' && c<='9') table[c] = 26 + (c - '0');
+        else if(c == '\'') table[c] = 36;
+        else table[c] = -1;
+    }
+    return table;
 }
 
-// Basic inserts a word into the trie;
-// Input: word: a string of word;
-void Trie::insert(string word) {
-    Node* ptr = root;
-    for(char c:word){ 
-        int ind = c - 'a';
-        if(ptr->letter_vec[ind] == NULL){
-            ptr->letter_vec[ind] = new Node;
+const array<int8_t, 256> kSymbolIndex = make_symbol_index();
+
+// Symbol of every child slot;
+static constexpr char kSymbolChar[kAlphabetSize + 1] = "abcdefghijklmnopqrstuvwxyz0123456789'";
+
+// The scans visit children in lexicographic order: ' (slot 36), 0-9 (slots
+// 26-35), a-z (slots 0-25). Reorder a child mask so that bit r is the child
+// of rank r in that order;
+static uint64_t ordered_children(uint64_t mask){
+    return ((mask >> 36) & 1) | (((mask >> 26) & 0x3ff) << 1) | ((mask & 0x3ffffff) << 11);
+}
+
+static int rank_slot(int rank){
+    if(rank == 0) return 36;
+    if(rank <= 10) return 25 + rank;
+    return rank - 11;
+}
+
+static int slot_rank(int slot){
+    if(slot == 36) return 0;
+    if(slot >= 26) return slot - 25;
+    return slot + 11;
+}
+
+// Header of a snapshot file, the arenas follow in this order, each one
+// starting at a multiple of 8 bytes.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t node_count;
+    uint64_t child_count;
+    uint64_t posting_count;
+    uint64_t location_count;
+};
+
+static constexpr char kSnapshotMagic[8] = {'B', 'U', 'Z', 'Z', 'T', 'R', 'I', 'E'};
+static constexpr uint32_t kSnapshotVersion = 3;
+
+static size_t align8(size_t offset) {return (offset + 7) & ~size_t(7);}
+
+// The location pool is a byte array, words in it are accessed unaligned;
+static uint32_t load32(const uint8_t* ptr){
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static void store32(uint8_t* ptr, uint32_t value){
+    memcpy(ptr, &value, sizeof(value));
+}
+
+// Write value as varint (7 bits per byte, high bit set if more bytes follow);
+// Output: number of bytes written, at most 5.
+static uint32_t encode_varint(uint32_t value, uint8_t* out){
+    uint32_t size = 0;
+    while(value >= 0x80){
+        out[size++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<uint8_t>(value);
+    return size;
+}
+
+// Read a varint and advance ptr behind it;
+static uint32_t decode_varint(const uint8_t* &ptr){
+    uint32_t value = *ptr & 0x7f;
+    for(int shift = 7; *ptr++ & 0x80; shift += 7){
+        value |= static_cast<uint32_t>(*ptr & 0x7f) << shift;
+    }
+    return value;
+}
+
+// Constructor for Trie, node 0 is the root;
+Trie::Trie() {clear();}
+
+// Drop all the arenas at once. The nodes and locations are plain data, so
+// there is nothing to walk: every arena is a single deallocation;
+void Trie::clear(){
+    snapshot.reset();
+    vector<Node>().swap(nodes);
+    vector<uint32_t>().swap(child_pool);
+    vector<PostingList>().swap(postings);
+    vector<uint8_t>().swap(location_pool);
+    for(uint32_t &head : free_blocks) head = kNoBlock;
+    nodes.push_back({0, 0, kNoPosting});
+    sync_view();
+}
+
+// Copy the trie, the copy gets its own view;
+Trie Trie::clone() const {
+    Trie trie;
+    trie.nodes = nodes;
+    trie.child_pool = child_pool;
+    trie.postings = postings;
+    trie.location_pool = location_pool;
+    copy(free_blocks, free_blocks + kCapClasses, trie.free_blocks);
+    trie.snapshot = snapshot;
+    if(snapshot) trie.view = view;
+    else trie.sync_view();
+    return trie;
+}
+
+void Trie::sync_view(){
+    view = {nodes.data(), child_pool.data(), postings.data(), location_pool.data(),
+            nodes.size(), child_pool.size(), postings.size(), location_pool.size()};
+}
+
+// Copy the mapped snapshot into the vectors, the holes of freed child blocks
+// are not tracked in the snapshot and stay unused;
+void Trie::thaw(){
+    nodes.assign(view.nodes, view.nodes + view.node_count);
+    child_pool.assign(view.child_pool, view.child_pool + view.child_count);
+    postings.assign(view.postings, view.postings + view.posting_count);
+    location_pool.assign(view.location_pool, view.location_pool + view.location_count);
+    for(uint32_t &head : free_blocks) head = kNoBlock;
+    snapshot.reset();
+    sync_view();
+}
+
+// Find the smallest capacity class that can hold size children;
+int Trie::cap_class(uint32_t size){
+    int cls = 0;
+    while(kCapacity[cls] < size) cls++;
+    return cls;
+}
+
+// Get a child block of the given capacity class, reuse a freed one if possible;
+uint32_t Trie::alloc_children(int cls){
+    uint32_t block = free_blocks[cls];
+    if(block != kNoBlock){
+        free_blocks[cls] = child_pool[block];
+        return block;
+    }
+    block = static_cast<uint32_t>(child_pool.size());
+    child_pool.resize(child_pool.size() + kCapacity[cls]);
+    return block;
+}
+
+// Put a child block back to the free list of its class;
+void Trie::free_children(uint32_t block, int cls){
+    child_pool[block] = free_blocks[cls];
+    free_blocks[cls] = block;
+}
+
+// Get the child of node for symbol, kNoNode if there is none;
+uint32_t Trie::child(const Node* node_arena, const uint32_t* child_arena, uint32_t node, int symbol){
+    const Node &n = node_arena[node];
+    uint64_t bit = 1ull << symbol;
+    if(!(n.child_mask & bit)) return kNoNode;
+    return child_arena[n.children + __builtin_popcountll(n.child_mask & (bit - 1))];
+}
+
+// Create the child of node for symbol, the child must not exist yet;
+uint32_t Trie::add_child(uint32_t node, int symbol){
+    uint32_t id = static_cast<uint32_t>(nodes.size());
+    nodes.push_back({0, 0, kNoPosting});
+    Node &n = nodes[node];
+    uint64_t bit = 1ull << symbol;
+    uint32_t size = __builtin_popcountll(n.child_mask);
+    uint32_t pos = __builtin_popcountll(n.child_mask & (bit - 1));
+    if(size == 0){
+        n.children = alloc_children(0);
+    }
+    else{
+        int cls = cap_class(size);
+        if(size == kCapacity[cls]){
+            // The block is full, move the children to a block of the next class;
+            uint32_t block = alloc_children(cls + 1);
+            for(uint32_t i = 0; i < size; i++){
+                child_pool[block + i + (i >= pos)] = child_pool[n.children + i];
+            }
+            free_children(n.children, cls);
+            n.children = block;
+        }
+        else{
+            for(uint32_t i = size; i > pos; i--){
+                child_pool[n.children + i] = child_pool[n.children + i - 1];
+            }
         }
-       ptr = ptr->letter_vec[ind];
     }
-    ptr->end = true;
+    child_pool[n.children + pos] = id;
+    n.child_mask |= bit;
+    return id;
+}
+
+// Walk down the trie;
+// Input: word: a string of word. Output: the node of the word or kNoNode;
+uint32_t Trie::find(string_view word) const {
+    if(word.empty()) return kNoNode;
+    uint32_t node = 0;
+    for(char c : word){
+        int ind = symbol_index(c);
+        if(ind < 0) return kNoNode;
+        node = child(view.nodes, view.child_pool, node, ind);
+        if(node == kNoNode) return kNoNode;
+    }
+    return node;
+}
+
+// Walk down the trie and create the missing nodes;
+// Input: word: a string of word. Output: the node of the word or kNoNode for invalid words;
+uint32_t Trie::find_or_create(string_view word){
+    if(word.empty()) return kNoNode;
+    uint32_t node = 0;
+    for(char c : word){
+        int ind = symbol_index(c);
+        if(ind < 0) return kNoNode;
+        uint32_t next = child(nodes.data(), child_pool.data(), node, ind);
+        node = (next == kNoNode) ? add_child(node, ind) : next;
+    }
+    return node;
+}
+
+uint32_t Trie::new_posting(){
+    postings.push_back({0, 0, 0, 0, kNoDirectory});
+    return static_cast<uint32_t>(postings.size() - 1);
+}
+
+// Basic inserts a word into the trie;
+// Input: word: a string of word;
+void Trie::insert(string_view word) {
+    if(snapshot) thaw();
+    uint32_t node = find_or_create(word);
+    if(node != kNoNode && nodes[node].posting == kNoPosting) nodes[node].posting = new_posting();
+    sync_view();
     return;
 }
-    
+
 // Basic search in Trie;
 // Input: word: a string of word;
-bool Trie::search(string word) {
-    Node* ptr = root;
-    for(char c : word){
-        int ind = c - 'a';
-        if(!ptr->letter_vec[ind]){
-            return false;
-        }
-        ptr = ptr->letter_vec[ind];
-    }
-    if(ptr->end) return true;
-    return false;
+bool Trie::search(string_view word) const {
+    uint32_t node = find(word);
+    return node != kNoNode && view.nodes[node].posting != kNoPosting;
 }
-    
+
 // Returns if there is any word in the trie that starts with the given prefix;
 // Input: prefix: a string of word;
-bool Trie::startsWith(string prefix) {
-    Node* ptr = root;
-    for(char c: prefix){
-        int ind = c - 'a';
-        if(!ptr->letter_vec[ind]){
-            return false;
-        }
-        ptr = ptr->letter_vec[ind];
-    }
-    return true;   
+bool Trie::startsWith(string_view prefix) const {
+    if(prefix.empty()) return view.nodes[0].child_mask != 0;
+    return find(prefix) != kNoNode;
 }
 
 // Insert with other valid letter;
 // Input: word: a string of word. index: the index of the word in the file;
-void Trie::insert_with_loc(string word, int index){
-    Node* ptr = root;
-    int ind;
-    for(char c:word){ 
-        if(c>='a' && c<= 'z') ind = c - 'a';
-        else if(c>='0' && c <='9') ind = 26 + (c - '0');
-        else ind = 36;
-        if(ptr->letter_vec[ind] == NULL){
-            ptr->letter_vec[ind] = new Node;
-        }
-       ptr = ptr->letter_vec[ind];
-    }
-    ptr->end = true;
-    ptr->location.push_back(index);
+void Trie::insert_with_loc(string_view word, int index){
+    if(snapshot) thaw();
+    uint32_t node = find_or_create(word);
+    if(node == kNoNode){
+        sync_view();
+        return;
+    }
+    if(nodes[node].posting == kNoPosting) nodes[node].posting = new_posting();
+    append_location(postings[nodes[node].posting], static_cast<uint32_t>(index));
+    sync_view();
     return;
 }
 
+// Append a location to a list, open a new chunk when the tail is full;
+// Input: list: the posting list. location: larger than all locations in the list;
+void Trie::append_location(PostingList &list, uint32_t location){
+    uint8_t delta[5];
+    uint32_t delta_size = 0;
+    uint32_t in_chunk = 0, size = 0, used = 0;
+    if(list.count > 0){
+        size = load32(&location_pool[list.tail + 4]);
+        in_chunk = list.count - load32(&location_pool[list.tail + 8]);
+        used = load32(&location_pool[list.tail + 12]);
+        uint32_t skips = (in_chunk + kSkipInterval - 1) / kSkipInterval;
+        uint32_t room = size - kChunkHeader - used - 8 * skips;
+        uint32_t need = 8;
+        if(in_chunk % kSkipInterval != 0){
+            delta_size = encode_varint(location - list.last, delta);
+            need = delta_size;
+        }
+        if(need > room) in_chunk = 0;
+    }
+    if(list.count == 0 || in_chunk == 0){
+        // Open a new chunk, its first location is a skip entry;
+        uint32_t chunk = static_cast<uint32_t>(location_pool.size());
+        size = (list.count == 0) ? kFirstChunk : min(2 * size, kMaxChunk);
+        location_pool.resize(location_pool.size() + size);
+        store32(&location_pool[chunk], 0);
+        store32(&location_pool[chunk + 4], size);
+        store32(&location_pool[chunk + 8], list.count);
+        if(list.count == 0) list.head = chunk;
+        else{
+            store32(&location_pool[list.tail], chunk);
+            add_to_directory(list, chunk);
+        }
+        list.tail = chunk;
+        used = 0;
+    }
+    if(in_chunk % kSkipInterval == 0){
+        uint32_t skip = list.tail + size - 8 * (in_chunk / kSkipInterval + 1);
+        store32(&location_pool[skip], location);
+        store32(&location_pool[skip + 4], used);
+    }
+    else{
+        memcpy(&location_pool[list.tail + kChunkHeader + used], delta, delta_size);
+        used += delta_size;
+    }
+    store32(&location_pool[list.tail + 12], used);
+    list.last = location;
+    list.count++;
+}
+
+// Add a chunk to the directory of a list. The directory is made when the
+// second chunk is opened, a full one is moved to a block twice as large and
+// the old block is left unused, that is at most as much as the directory;
+// Input: list: the posting list. chunk: the chunk that was just opened;
+void Trie::add_to_directory(PostingList &list, uint32_t chunk){
+    uint32_t capacity = 0, used = 0;
+    if(list.directory != kNoDirectory){
+        capacity = load32(&location_pool[list.directory]);
+        used = load32(&location_pool[list.directory + 4]);
+    }
+    if(used == capacity){
+        uint32_t grown = max(2 * capacity, kFirstDirectory);
+        uint32_t block = static_cast<uint32_t>(location_pool.size());
+        location_pool.resize(location_pool.size() + 8 + 4 * grown);
+        store32(&location_pool[block], grown);
+        if(list.directory == kNoDirectory){
+            store32(&location_pool[block + 8], list.head);
+            used = 1;
+        }
+        else{
+            memcpy(&location_pool[block + 8], &location_pool[list.directory + 8], 4 * used);
+        }
+        list.directory = block;
+    }
+    store32(&location_pool[list.directory + 8 + 4 * used], chunk);
+    store32(&location_pool[list.directory + 4], used + 1);
+}
+
+// Get the nth location of a list: find its chunk in the directory, jump to
+// the closest skip entry and decode the deltas after it;
+// Input: pool: the location pool. list: the posting list. n: 0 based, below list.count;
+uint32_t Trie::nth_location(const uint8_t* pool, const PostingList &list, uint32_t n){
+    uint32_t chunk = list.head;
+    if(list.directory != kNoDirectory){
+        // The last chunk whose first ordinal is at most n;
+        const uint8_t* chunks = pool + list.directory + 8;
+        uint32_t low = 0, high = load32(pool + list.directory + 4);
+        while(high - low > 1){
+            uint32_t mid = low + (high - low) / 2;
+            if(load32(pool + load32(chunks + 4 * mid) + 8) <= n) low = mid;
+            else high = mid;
+        }
+        chunk = load32(chunks + 4 * low);
+    }
+    uint32_t size = load32(pool + chunk + 4);
+    uint32_t in_chunk = n - load32(pool + chunk + 8);
+    const uint8_t* skip = pool + chunk + size - 8 * (in_chunk / kSkipInterval + 1);
+    uint32_t location = load32(skip);
+    const uint8_t* data = pool + chunk + kChunkHeader + load32(skip + 4);
+    for(uint32_t i = in_chunk % kSkipInterval; i > 0; i--){
+        location += decode_varint(data);
+    }
+    return location;
+}
+
+// Decode a list chunk by chunk, a skip entry sets the location and the
+// deltas in between follow each other in the chunk;
+template <typename F>
+void Trie::for_each_location(const uint8_t* pool, const PostingList &list, F &&f){
+    uint32_t chunk = list.head;
+    for(uint32_t n = 0; n < list.count; chunk = load32(pool + chunk)){
+        uint32_t size = load32(pool + chunk + 4);
+        uint32_t end = (chunk == list.tail) ? list.count : load32(pool + load32(pool + chunk) + 8);
+        const uint8_t* data = pool + chunk + kChunkHeader;
+        uint32_t location = 0;
+        for(uint32_t in_chunk = 0; n < end; in_chunk++, n++){
+            if(in_chunk % kSkipInterval == 0) location = load32(pool + chunk + size - 8 * (in_chunk / kSkipInterval + 1));
+            else location += decode_varint(data);
+            f(location);
+        }
+    }
+}
+
 // Search the location of the word in the Trie;
 // Input: word: a string of word. index: the appearance time of the word to search, result: store the result;
-void Trie::search_with_loc(string word, int index, string &result){
-    Node* ptr = root;
-    if(ptr == NULL){
-        // no file loaded
+void Trie::search_with_loc(string_view word, int index, string &result) const {
+    uint32_t node = find(word);
+    if(node == kNoNode || view.nodes[node].posting == kNoPosting || index <= 0){
         result = "No matching entry";
         return;
     }
-    int ind;
-    for(char c : word){
-        if(c>='a'&& c<='z') ind = c - 'a';
-        else if(c>='0'&& c<='1') ind = c - '0';
-        else ind = 36;
-        if(ind < 0 || ind >= 37){
-            // out of index
-            result = "ERROR: Invalid command";
-            return;
-        }
-        if(ptr->letter_vec[ind] == NULL){
-            result = "No matching entry";
-            return;
-        }
-        ptr = ptr->letter_vec[ind];
-    }
-    if(ptr->end){
-        if((int)ptr->location.size() >= index){// avoud sig fault;
-            result = to_string(ptr->location[index-1]);
-            return;
-        }
-    } 
-    result = "No matching entry";
+    const PostingList &list = view.postings[view.nodes[node].posting];
+    uint32_t n = static_cast<uint32_t>(index - 1);
+    if(n >= list.count){
+        result = "No matching entry";
+        return;
+    }
+    result = to_string(nth_location(view.location_pool, list, n));
+    return;
+}
+
+// Number of locations of word;
+// Input: word: a string of word;
+uint32_t Trie::count(string_view word) const {
+    uint32_t node = find(word);
+    if(node == kNoNode || view.nodes[node].posting == kNoPosting) return 0;
+    return count_of(node);
+}
+
+// Answer a batch of queries;
+// Input: queries: the queries. count: number of queries. results: one location per query. counts: optional;
+void Trie::locate_batch(const LocateQuery* queries, size_t count, uint32_t* results, uint32_t* counts) const {
+    // Sort by the first 8 bytes packed into an integer, the full words only
+    // break ties;
+    vector<pair<uint64_t, uint32_t>> order(count);
+    for(uint32_t i = 0; i < count; i++){
+        uint64_t key = 0;
+        string_view word = queries[i].word;
+        for(size_t j = 0; j < 8; j++){
+            key = (key << 8) | (j < word.size() ? static_cast<unsigned char>(word[j]) : 0);
+        }
+        order[i] = {key, i};
+    }
+    sort(order.begin(), order.end(), [&](const pair<uint64_t, uint32_t> &a, const pair<uint64_t, uint32_t> &b){
+        if(a.first != b.first) return a.first < b.first;
+        return queries[a.second].word < queries[b.second].word;
+    });
+    // path[d] is the node reached after d symbols of the previous word;
+    vector<uint32_t> path(1, 0);
+    string_view prev;
+    for(const auto &[key, i] : order){
+        string_view word = queries[i].word;
+        size_t depth = 0;
+        size_t limit = min(word.size(), path.size() - 1);
+        while(depth < limit && symbol_index(word[depth]) == symbol_index(prev[depth])) depth++;
+        path.resize(depth + 1);
+        uint32_t node = path[depth];
+        for(; depth < word.size(); depth++){
+            int ind = symbol_index(word[depth]);
+            if(ind < 0) break;
+            node = child(view.nodes, view.child_pool, node, ind);
+            if(node == kNoNode) break;
+            path.push_back(node);
+        }
+        prev = word;
+        results[i] = kNoLocation;
+        if(counts) counts[i] = 0;
+        if(word.empty() || depth != word.size() || view.nodes[node].posting == kNoPosting) continue;
+        const PostingList &list = view.postings[view.nodes[node].posting];
+        if(counts) counts[i] = list.count;
+        uint32_t occurrence = queries[i].occurrence;
+        if(occurrence > 0 && occurrence <= list.count){
+            results[i] = nth_location(view.location_pool, list, occurrence - 1);
+        }
+    }
+}
+
+uint32_t Trie::count_of(uint32_t node) const {
+    return view.postings[view.nodes[node].posting].count;
+}
+
+// Walk the frames on the stack in pre order, word holds the symbols of the
+// path to the top frame;
+template <typename Step, typename Accept>
+void Trie::walk(vector<ScanFrame> &stack, string &word, Step &&step, Accept &&accept, const WordVisitor &visit) const {
+    while(!stack.empty()){
+        ScanFrame &top = stack.back();
+        if(top.pending == 0){
+            stack.pop_back();
+            if(!stack.empty()) word.pop_back();
+            continue;
+        }
+        int slot = rank_slot(__builtin_ctzll(top.pending));
+        top.pending &= top.pending - 1;
+        uint64_t state = top.state;
+        if(!step(slot, state)) continue;
+        uint32_t next = child(view.nodes, view.child_pool, top.node, slot);
+        word.push_back(kSymbolChar[slot]);
+        if(accept(state) && view.nodes[next].posting != kNoPosting && !visit(word, count_of(next))) return;
+        stack.push_back({next, ordered_children(view.nodes[next].child_mask), state});
+    }
+}
+
+// Visit all words that start with prefix;
+// Input: prefix: a string of word. visit: called for every word;
+void Trie::scan_prefix(string_view prefix, const WordVisitor &visit) const {
+    static thread_local vector<ScanFrame> stack;
+    static thread_local string word;
+    uint32_t node = 0;
+    word.clear();
+    if(!prefix.empty()){
+        node = find(prefix);
+        if(node == kNoNode) return;
+        for(char c : prefix) word.push_back(kSymbolChar[symbol_index(c)]);
+        if(view.nodes[node].posting != kNoPosting && !visit(word, count_of(node))) return;
+    }
+    stack.clear();
+    stack.push_back({node, ordered_children(view.nodes[node].child_mask), 0});
+    walk(stack, word, [](int, uint64_t&){return true;}, [](uint64_t){return true;}, visit);
+}
+
+// Visit all words matching pattern. The pattern runs as an NFA over the
+// trie: the state of a node has bit p set when the path to the node can be
+// matched by the first p symbols of the pattern, so every node is reached
+// once no matter how many ways the '*' can match;
+// Input: pattern: symbols, '?' and '*'. visit: called for every word;
+void Trie::scan_pattern(string_view pattern, const WordVisitor &visit) const {
+    static thread_local vector<ScanFrame> stack;
+    static thread_local string word;
+    size_t length = pattern.size();
+    if(length > kMaxPattern) return;
+    for(char c : pattern){
+        if(c != '?' && c != '*' && symbol_index(c) < 0) return;
+    }
+    // A '*' that is alive can also match nothing;
+    auto closure = [&](uint64_t state){
+        for(size_t p = 0; p < length; p++){
+            if(pattern[p] == '*' && (state >> p & 1)) state |= 1ull << (p + 1);
+        }
+        return state;
+    };
+    auto step = [&](int slot, uint64_t &state){
+        uint64_t next = 0;
+        for(uint64_t alive = state & ((1ull << length) - 1); alive; alive &= alive - 1){
+            size_t p = __builtin_ctzll(alive);
+            if(pattern[p] == '*') next |= 1ull << p;
+            else if(pattern[p] == '?' || symbol_index(pattern[p]) == slot) next |= 1ull << (p + 1);
+        }
+        state = closure(next);
+        return state != 0;
+    };
+    uint64_t final_state = 1ull << length;
+    word.clear();
+    stack.clear();
+    stack.push_back({0, ordered_children(view.nodes[0].child_mask), closure(1)});
+    walk(stack, word, step, [&](uint64_t state){return (state & final_state) != 0;}, visit);
+}
+
+// Visit all words w with from <= w <= to. The stack is set up as if the walk
+// had just reached from: every frame on its path only keeps the children
+// after it. The walk stops at the first word after to;
+// Input: from, to: strings of word. visit: called for every word;
+void Trie::scan_range(string_view from, string_view to, const WordVisitor &visit) const {
+    static thread_local vector<ScanFrame> stack;
+    static thread_local string word, last;
+    last.clear();
+    for(char c : from) if(symbol_index(c) < 0) return;
+    for(char c : to){
+        if(symbol_index(c) < 0) return;
+        last.push_back(kSymbolChar[symbol_index(c)]);
+    }
+    WordVisitor bounded = [&](string_view found, uint32_t count){
+        return found <= string_view(last) && visit(found, count);
+    };
+    word.clear();
+    stack.clear();
+    stack.push_back({0, ordered_children(view.nodes[0].child_mask), 0});
+    for(size_t d = 0; d < from.size(); d++){
+        int slot = symbol_index(from[d]);
+        ScanFrame &top = stack.back();
+        top.pending &= ~((2ull << slot_rank(slot)) - 1);
+        uint32_t next = child(view.nodes, view.child_pool, top.node, slot);
+        if(next == kNoNode) break;
+        word.push_back(kSymbolChar[slot]);
+        stack.push_back({next, ordered_children(view.nodes[next].child_mask), 0});
+        if(d + 1 == from.size() && view.nodes[next].posting != kNoPosting && !bounded(word, count_of(next))) return;
+    }
+    walk(stack, word, [](int, uint64_t&){return true;}, [](uint64_t){return true;}, bounded);
+}
+
+// Move shards into this empty trie;
+// Input: shards: shards[s] only holds words starting with symbol s. threads: number of threads to use;
+void Trie::merge_shards(vector<Trie> &shards, unsigned threads){
+    if(snapshot) thaw();
+    if(nodes.size() != 1 || shards.size() > kAlphabetSize){
+        throw invalid_argument("merge_shards needs an empty trie and one shard per symbol");
+    }
+    // Every shard gets its own range in each arena, the shard roots are dropped;
+    struct Base {uint32_t node, child, posting, location;};
+    vector<Base> base(shards.size());
+    size_t node_count = nodes.size(), child_count = child_pool.size();
+    size_t posting_count = postings.size(), location_count = location_pool.size();
+    for(size_t s = 0; s < shards.size(); s++){
+        base[s] = {static_cast<uint32_t>(node_count - 1), static_cast<uint32_t>(child_count),
+                   static_cast<uint32_t>(posting_count), static_cast<uint32_t>(location_count)};
+        node_count += shards[s].nodes.size() - 1;
+        child_count += shards[s].child_pool.size();
+        posting_count += shards[s].postings.size();
+        location_count += shards[s].location_pool.size();
+    }
+    nodes.resize(node_count);
+    child_pool.resize(child_count);
+    postings.resize(posting_count);
+    location_pool.resize(location_count);
+
+    // Hook the shards below the root before they are released;
+    uint32_t root_children = 0;
+    for(size_t s = 0; s < shards.size(); s++){
+        uint32_t top = child(shards[s].nodes.data(), shards[s].child_pool.data(), 0, static_cast<int>(s));
+        if(top == kNoNode) continue;
+        nodes[0].child_mask |= 1ull << s;
+        root_children++;
+    }
+    if(root_children > 0){
+        uint32_t block = alloc_children(cap_class(root_children));
+        uint32_t pos = 0;
+        for(size_t s = 0; s < shards.size(); s++){
+            uint32_t top = child(shards[s].nodes.data(), shards[s].child_pool.data(), 0, static_cast<int>(s));
+            if(top != kNoNode) child_pool[block + pos++] = base[s].node + top;
+        }
+        nodes[0].children = block;
+    }
+
+    // Relocate the shards, node ids, child blocks, posting ids, chunk links
+    // and directories move by the base of their shard, the locations stay as they are;
+    atomic<size_t> next_shard{0};
+    auto relocate = [&](){
+        for(size_t s = next_shard++; s < shards.size(); s = next_shard++){
+            Trie &shard = shards[s];
+            const Base &b = base[s];
+            for(size_t i = 1; i < shard.nodes.size(); i++){
+                Node n = shard.nodes[i];
+                if(n.child_mask) n.children += b.child;
+                if(n.posting != kNoPosting) n.posting += b.posting;
+                nodes[b.node + i] = n;
+            }
+            for(size_t i = 0; i < shard.child_pool.size(); i++){
+                child_pool[b.child + i] = shard.child_pool[i] + b.node;
+            }
+            copy(shard.location_pool.begin(), shard.location_pool.end(), location_pool.begin() + b.location);
+            for(size_t i = 0; i < shard.postings.size(); i++){
+                PostingList list = shard.postings[i];
+                list.head += b.location;
+                list.tail += b.location;
+                for(uint32_t chunk = list.head; chunk != list.tail; chunk = load32(&location_pool[chunk])){
+                    store32(&location_pool[chunk], load32(&location_pool[chunk]) + b.location);
+                }
+                if(list.directory != kNoDirectory){
+                    list.directory += b.location;
+                    uint32_t used = load32(&location_pool[list.directory + 4]);
+                    for(uint32_t j = 0; j < used; j++){
+                        uint32_t entry = list.directory + 8 + 4 * j;
+                        store32(&location_pool[entry], load32(&location_pool[entry]) + b.location);
+                    }
+                }
+                postings[b.posting + i] = list;
+            }
+            shard.clear();
+        }
+    };
+    vector<thread> workers;
+    for(unsigned t = 1; t < threads; t++) workers.emplace_back(relocate);
+    relocate();
+    for(thread &worker : workers) worker.join();
+    sync_view();
     return;
-}   
+}
+
+// Insert every word of other with its locations, in order;
+// Input: other: a trie whose locations all come after the ones of this trie;
+void Trie::append_trie(const Trie &other){
+    if(snapshot) thaw();
+    other.scan_prefix("", [&](string_view word, uint32_t){
+        const PostingList &from = other.view.postings[other.view.nodes[other.find(word)].posting];
+        uint32_t node = find_or_create(word);
+        if(nodes[node].posting == kNoPosting) nodes[node].posting = new_posting();
+        PostingList &list = postings[nodes[node].posting];
+        for_each_location(other.view.location_pool, from, [&](uint32_t location){append_location(list, location);});
+        return true;
+    });
+    sync_view();
+    return;
+}
+
+// Write the trie to a snapshot file, the file is written next to its final
+// place and renamed, so a crash never leaves a half written snapshot behind;
+// Input: filename: the snapshot file;
+bool Trie::save(const string &filename) const {
+    SnapshotHeader header;
+    memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+    header.version = kSnapshotVersion;
+    header.reserved = 0;
+    header.node_count = view.node_count;
+    header.child_count = view.child_count;
+    header.posting_count = view.posting_count;
+    header.location_count = view.location_count;
+    string temp_name = filename + ".tmp";
+    ofstream out(temp_name, ios::binary | ios::trunc);
+    if(!out.is_open()) return false;
+    const char padding[8] = {};
+    size_t offset = 0;
+    auto write_section = [&](const void* data, size_t bytes){
+        out.write(padding, align8(offset) - offset);
+        out.write(static_cast<const char*>(data), bytes);
+        offset = align8(offset) + bytes;
+    };
+    write_section(&header, sizeof(header));
+    write_section(view.nodes, view.node_count * sizeof(Node));
+    write_section(view.child_pool, view.child_count * sizeof(uint32_t));
+    write_section(view.postings, view.posting_count * sizeof(PostingList));
+    write_section(view.location_pool, view.location_count);
+    out.close();
+    if(!out || rename(temp_name.c_str(), filename.c_str()) != 0){
+        remove(temp_name.c_str());
+        return false;
+    }
+    return true;
+}
 
+// Map a snapshot file and point the view into it. Only the header is
+// checked, the arenas are trusted to be written by save();
+// Input: filename: the snapshot file;
+bool Trie::open(const string &filename){
+    auto file = make_shared<MappedFile>(filename, false);
+    if(!file->is_mapped() || file->size() < sizeof(SnapshotHeader)) return false;
+    SnapshotHeader header;
+    memcpy(&header, file->data(), sizeof(header));
+    if(memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) != 0 || header.version != kSnapshotVersion){
+        return false;
+    }
+    // All references are 32 bit, so no arena can be larger;
+    if(header.node_count == 0 || header.node_count > UINT32_MAX || header.child_count > UINT32_MAX ||
+       header.posting_count > UINT32_MAX || header.location_count > UINT32_MAX){
+        return false;
+    }
+    size_t offsets[5];
+    offsets[0] = align8(sizeof(header));
+    offsets[1] = align8(offsets[0] + header.node_count * sizeof(Node));
+    offsets[2] = align8(offsets[1] + header.child_count * sizeof(uint32_t));
+    offsets[3] = align8(offsets[2] + header.posting_count * sizeof(PostingList));
+    offsets[4] = offsets[3] + header.location_count;
+    if(offsets[4] > file->size()) return false;
+    View mapped;
+    mapped.nodes = reinterpret_cast<const Node*>(file->data() + offsets[0]);
+    mapped.child_pool = reinterpret_cast<const uint32_t*>(file->data() + offsets[1]);
+    mapped.postings = reinterpret_cast<const PostingList*>(file->data() + offsets[2]);
+    mapped.location_pool = reinterpret_cast<const uint8_t*>(file->data() + offsets[3]);
+    mapped.node_count = header.node_count;
+    mapped.child_count = header.child_count;
+    mapped.posting_count = header.posting_count;
+    mapped.location_count = header.location_count;
+    clear();
+    view = mapped;
+    snapshot = move(file);
+    return true;
+}
+
+// Bytes held by the arenas;
+size_t Trie::memory_usage() const {
+    return nodes.capacity() * sizeof(Node) + child_pool.capacity() * sizeof(uint32_t) +
+           postings.capacity() * sizeof(PostingList) + location_pool.capacity();
+}
+
+}
 }
-}
\ No newline at end of file
@@ -14,6 +14,7 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include "tutorial/corpus.h"
 #include "tutorial/tutorial.h"
 
 
@@ -60,21 +61,170 @@ vector<string> fetch_word(string com, Com_Type & com_type){
         return result;
     }
     if(result[0] == "load") com_type = LOAD;
+    else if(result[0] == "append") com_type = APPEND;
     else if(result[0] == "locate") com_type = LOCATE;
     else if(result[0] == "new") com_type = NEW;
     else if(result[0] == "end") com_type = END;
+    else if(result[0] == "save") com_type = SAVE;
+    else if(result[0] == "open") com_type = OPEN;
+    else if(result[0] == "prefix") com_type = PREFIX;
+    else if(result[0] == "match") com_type = MATCH;
+    else if(result[0] == "range") com_type = RANGE;
     else com_type = BAD;
     return result;
 }
 
+// Check that a command argument is a valid word: only contains a-z,0-9,';
+static bool valid_word(const string &word){
+    for(char c : word){
+        if(symbol_index(c) < 0) return false;
+    }
+    return !word.empty();
+}
+
+// Parse the optional limit of the scan commands, decimal digits only and at least 1;
+// Input: com_vec: contains the command info. pos: position of the limit. Output: false if the limit is invalid.
+static bool parse_limit(const vector<string> &com_vec, size_t pos, size_t &limit){
+    limit = kDefaultScanLimit;
+    if(com_vec.size() <= pos) return true;
+    uint64_t value = 0;
+    for(char c : com_vec[pos]){
+        if(c < '0' || c > '9') return false;
+        value = min<uint64_t>(value * 10 + (c - '0'), UINT32_MAX);
+    }
+    limit = static_cast<size_t>(value);
+    return limit > 0;
+}
+
+// Parse the occurrence of a locate query, decimal digits only, 1 up to INT32_MAX;
+// Input: token: the occurrence. Output: false if the occurrence is invalid.
+static bool parse_occurrence(string_view token, uint32_t &occurrence){
+    uint64_t value = 0;
+    for(char c : token){
+        if(c < '0' || c > '9') return false;
+        value = min<uint64_t>(value * 10 + (c - '0'), uint64_t(INT32_MAX) + 1);
+    }
+    occurrence = static_cast<uint32_t>(value);
+    return value > 0 && value <= INT32_MAX;
+}
+
+// Collect the words of a scan as "word count" lines, at most limit of them;
+// Input: scan: runs the scan with the given visitor. result: gets the lines.
+template <typename Scan>
+static void collect_words(Scan &&scan, size_t limit, string &result){
+    size_t found = 0;
+    scan([&](string_view word, uint32_t count){
+        if(found > 0) result += '\n';
+        result.append(word.data(), word.size());
+        result += ' ';
+        result += to_string(count);
+        return ++found < limit;
+    });
+    if(found == 0) result = "No matching entry";
+}
+
+// Version of a single trie;
+// Input: trie: the trie. words: the number of locations in it;
+static IndexVersion* single_layer(shared_ptr<const Trie> trie, uint64_t words){
+    return new IndexVersion{{{move(trie), words}}};
+}
+
+// Version of a loaded file, the tail word of state goes into a layer of its own;
+// Input: trie: the words before the tail. tail: the tail word, if state has one;
+static IndexVersion* loaded_version(shared_ptr<const Trie> trie, shared_ptr<const Trie> tail, const LoadState &state){
+    IndexVersion* version = single_layer(move(trie), state.append_index() - 1);
+    if(state.has_tail()){
+        version->layers.push_back({move(tail), 1});
+        version->tail = true;
+    }
+    return version;
+}
+
+// Merge the last layer into the one before it while it holds at least half
+// as many words. The merged layer is a new trie, the published ones are not
+// changed;
+// Input: version: a version that is not published yet;
+static void merge_layers(IndexVersion &version){
+    vector<IndexVersion::Layer> &layers = version.layers;
+    while(layers.size() > 1 && 2 * layers.back().words >= layers[layers.size() - 2].words){
+        IndexVersion::Layer last = layers.back();
+        layers.pop_back();
+        IndexVersion::Layer &prev = layers.back();
+        auto merged = make_shared<Trie>(prev.trie->clone());
+        merged->append_trie(*last.trie);
+        prev = {move(merged), prev.words + last.words};
+    }
+}
+
+// Collect the words of a scan over all layers like collect_words. Every
+// layer lists its first limit words, the first limit words of the version
+// are among them, and the counts of a word in several layers add up;
+// Input: scan: runs the scan on a trie with the given visitor. result: gets the lines.
+template <typename Scan>
+static void collect_layers(const IndexVersion &version, Scan &&scan, size_t limit, string &result){
+    if(version.layers.size() == 1){
+        const Trie &trie = *version.layers[0].trie;
+        collect_words([&](const WordVisitor &visit){scan(trie, visit);}, limit, result);
+        return;
+    }
+    vector<pair<string, uint32_t>> found;
+    for(const IndexVersion::Layer &layer : version.layers){
+        size_t listed = 0;
+        scan(*layer.trie, [&](string_view word, uint32_t count){
+            found.emplace_back(string(word), count);
+            return ++listed < limit;
+        });
+    }
+    stable_sort(found.begin(), found.end(), [](const pair<string, uint32_t> &a, const pair<string, uint32_t> &b){
+        return a.first < b.first;
+    });
+    collect_words([&](const WordVisitor &visit){
+        for(size_t i = 0; i < found.size();){
+            size_t j = i;
+            uint32_t count = 0;
+            for(; j < found.size() && found[j].first == found[i].first; j++) count += found[j].second;
+            if(!visit(found[i].first, count)) return;
+            i = j;
+        }
+    }, limit, result);
+}
+
 //Constructor and destructor for class CommandExecutor
-CommandExecutor::CommandExecutor(): current_db(new Trie()){}
+CommandExecutor::CommandExecutor(): current_db(single_layer(make_shared<Trie>(), 0)), epoch(1){}
 CommandExecutor::~CommandExecutor(){
-    if(current_db){
-        current_db->ReleaseMemory(current_db->root);
-        delete(current_db);
-        current_db = nullptr;
-    } 
+    delete(current_db.exchange(nullptr));     // no reader can be left at this point
+}
+
+// Take a reader slot. The slot is stored before current_db is loaded, so a
+// writer that swaps current_db after this either sees the slot or the reader
+// sees the new trie;
+size_t CommandExecutor::pin_reader(){
+    size_t slot = hash<thread::id>()(this_thread::get_id()) % kReaderSlots;
+    for(size_t tries = 1; ; tries++){
+        uint64_t expected = 0;
+        if(readers[slot].epoch.compare_exchange_weak(expected, epoch.load())) return slot;
+        slot = (slot + 1) % kReaderSlots;
+        if(tries % kReaderSlots == 0) this_thread::yield();     // all slots are taken
+    }
+}
+
+void CommandExecutor::unpin_reader(size_t slot){
+    readers[slot].epoch.store(0, memory_order_release);
+}
+
+// Swap the trie and wait for the readers of older epochs, new readers can
+// only load the new trie;
+void CommandExecutor::publish(IndexVersion* version){
+    IndexVersion* old = current_db.exchange(version);
+    uint64_t retired = epoch.fetch_add(1);
+    for(ReaderSlot &slot : readers){
+        uint64_t pinned = slot.epoch.load();
+        while(pinned != 0 && pinned <= retired){
+            this_thread::yield();
+            pinned = slot.epoch.load();
+        }
+    }
+    delete(old);
 }
 
 // The execute function: divide the command and run different handle function.
@@ -89,10 +239,17 @@ std::string CommandExecutor::execute(std::string command) {
     Com_Type com_type;
     vector<string> parsing_com = fetch_word(command,com_type);
     string result;
+    // Queries only read the trie, they pin it so that a concurrent load can not free it;
+    bool reader = com_type == LOCATE || com_type == SAVE || com_type == PREFIX || com_type == MATCH
+                  || com_type == RANGE;
+    ReaderPin pin(*this, reader);
     switch(com_type){
         case Com_Type::LOAD:
             handle_load(parsing_com,result);
             break;
+        case Com_Type::APPEND:
+            handle_append(parsing_com,result);
+            break;
         case Com_Type::LOCATE:
             handle_locate(parsing_com,result);
             break;
@@ -102,6 +259,21 @@ std::string CommandExecutor::execute(std::string command) {
         case Com_Type::END:
             handle_end(parsing_com,result);
             break;
+        case Com_Type::SAVE:
+            handle_save(parsing_com,result);
+            break;
+        case Com_Type::OPEN:
+            handle_open(parsing_com,result);
+            break;
+        case Com_Type::PREFIX:
+            handle_prefix(parsing_com,result);
+            break;
+        case Com_Type::MATCH:
+            handle_match(parsing_com,result);
+            break;
+        case Com_Type::RANGE:
+            handle_range(parsing_com,result);
+            break;
         default:
             // ERROR: Invalid command
             result = "ERROR: Invalid command";
@@ -110,6 +282,72 @@ std::string CommandExecutor::execute(std::string command) {
     return result;
 }
 
+// Answer many locate queries at once. The lines are split into views of the
+// input, nothing is copied per query, and the trie answers all of them in
+// one sorted pass.
+// Input: queries: one "word occurrence" pair per line. result: gets one answer per line.
+void CommandExecutor::locate_batch(std::string_view queries, std::string &result){
+    vector<LocateQuery> batch;
+    vector<bool> valid;
+    size_t pos = 0;
+    while(pos < queries.size()){
+        size_t end = queries.find('\n', pos);
+        if(end == std::string_view::npos) end = queries.size();
+        std::string_view line = queries.substr(pos, end - pos);
+        pos = end + 1;
+        // Split the line into at most three tokens, a third one is an error;
+        std::string_view tokens[3];
+        int count = 0;
+        size_t i = 0;
+        while(count < 3){
+            while(i < line.size() && isspace(static_cast<unsigned char>(line[i]))) i++;
+            if(i == line.size()) break;
+            size_t start = i;
+            while(i < line.size() && !isspace(static_cast<unsigned char>(line[i]))) i++;
+            tokens[count++] = line.substr(start, i - start);
+        }
+        if(count == 0) continue;
+        bool ok = count == 2;
+        for(char c : tokens[0]) ok = ok && symbol_index(c) >= 0;
+        uint32_t occurrence = 0;
+        ok = ok && parse_occurrence(tokens[1], occurrence);
+        batch.push_back({tokens[0], ok ? occurrence : 0});
+        valid.push_back(ok);
+    }
+    vector<uint32_t> locations(batch.size(), kNoLocation);
+    {
+        ReaderPin pin(*this);
+        IndexVersion* db = current_db.load();
+        // A query that is not answered by a layer skips its locations in
+        // the next one, an answered one gets occurrence 0 for the rest;
+        vector<uint32_t> found(batch.size());
+        vector<uint32_t> counts(batch.size());
+        for(size_t l = 0; db && l < db->layers.size(); l++){
+            db->layers[l].trie->locate_batch(batch.data(), batch.size(), found.data(), counts.data());
+            for(size_t i = 0; i < batch.size(); i++){
+                if(found[i] != kNoLocation){
+                    locations[i] = found[i];
+                    batch[i].occurrence = 0;
+                }
+                else if(batch[i].occurrence > counts[i]){
+                    batch[i].occurrence -= counts[i];
+                }
+                else{
+                    batch[i].occurrence = 0;
+                }
+            }
+        }
+    }
+    result.reserve(result.size() + batch.size() * 12);
+    for(size_t i = 0; i < batch.size(); i++){
+        if(!valid[i]) result += "ERROR: Invalid command";
+        else if(locations[i] == kNoLocation) result += "No matching entry";
+        else result += to_string(locations[i]);
+        result += '\n';
+    }
+    return;
+}
+
 // Use to load the given file and insert words into Trie.
 // Input: com_vec: contain the command info. result: Record the position info.
 void CommandExecutor::handle_load(vector<string> com_vec, string &result){
@@ -119,37 +357,74 @@ void CommandExecutor::handle_load(vector<string> com_vec, string &result){
         return;
     }
     std::string filename = com_vec[1];
-    std::ifstream inputFile(filename);
-    if (!inputFile.is_open()) {
+    // The words are tokenized right on the mapped file and inserted as views,
+    // nothing is copied per line or per word.
+    auto trie = make_shared<Trie>();
+    auto tail = make_shared<Trie>();
+    LoadState state;
+    if (!load_file(filename, *trie, thread::hardware_concurrency(), &state, tail.get())) {
         std::cerr << "Failed to open the file: " << filename << std::endl;
         result = "ERROR: Invalid command";
         return;
     }
-    std::string line;
-    if(current_db) current_db->ReleaseMemory(current_db->root);//do the cleaning stuff after the file is ready to read
-    delete(current_db);
-    current_db = nullptr;
-    Trie* trie = new Trie;
-    this->current_db = trie;
-    int index = 1;
-    while (std::getline(inputFile, line)) {
-        if(line == "") continue;
-        for(char& c:line){
-            //check the line and replace all invalid letter and symbles to ' '
-            if(validLettersAndSymbols.find(c) == string::npos) c = ' ';
-            if(isupper(c)) c = tolower(c);
-        }
-        std::istringstream iss(line);
-        //std::vector<std::string> words;
-        std::string word;
-        while (iss >> word) {
-            if(!word.empty()){
-                trie->insert_with_loc(word,index);//index is the index of the current word in the file.
-                index++;
+    // The trie is built without the lock, queries keep running on the old one;
+    lock_guard<mutex> lock(writer);
+    publish(loaded_version(move(trie), move(tail), state));      //do the cleaning stuff after the file is loaded, the arenas are released at once
+    loaded_file = filename;
+    load_state = state;
+    return;
+}
+
+// Use to load the words appended to the loaded file since the last load or
+// append. The new words go into a trie of their own that is published as a
+// new layer, the published layers are shared and not copied unless the new
+// one is large enough to be merged (see IndexVersion). Any other file is
+// loaded like load does.
+// Input: com_vec: contain the command info. result: Record the position info.
+void CommandExecutor::handle_append(vector<string> com_vec, string &result){
+    if(com_vec.size() != 2){
+        result = "ERROR: Invalid command";
+        return;
+    }
+    {
+        lock_guard<mutex> lock(writer);
+        IndexVersion* db = current_db.load();
+        if(db && com_vec[1] == loaded_file){
+            auto trie = make_shared<Trie>();
+            auto tail = make_shared<Trie>();
+            LoadState state = load_state;
+            if(!append_file(loaded_file, *trie, state, tail.get())){
+                std::cerr << "Failed to open the file: " << loaded_file << std::endl;
+                result = "ERROR: Invalid command";
+                return;
+            }
+            if(state.bytes < load_state.bytes){
+                // The file was truncated and loaded again;
+                publish(loaded_version(move(trie), move(tail), state));
             }
+            else if(state.bytes > load_state.bytes){
+                // The old tail word is in trie again, grown or not;
+                IndexVersion* version = new IndexVersion(*db);
+                if(version->tail){
+                    version->layers.pop_back();
+                    version->tail = false;
+                }
+                uint64_t words = static_cast<uint64_t>(state.append_index() - load_state.append_index());
+                if(words > 0){
+                    version->layers.push_back({move(trie), words});
+                    merge_layers(*version);
+                }
+                if(state.has_tail()){
+                    version->layers.push_back({move(tail), 1});
+                    version->tail = true;
+                }
+                publish(version);
+            }
+            load_state = state;
+            return;
         }
     }
-    inputFile.close();
+    handle_load(com_vec, result);
     return;
 }
 
@@ -161,9 +436,9 @@ void CommandExecutor::handle_locate(vector<string> com_vec,string &result){
         result = "ERROR: Invalid command";
         return;
     }
-    for(char c:com_vec[2]){
-        //number error
-        if(c>='0' && c<='9') continue;
+    uint32_t occurrence;
+    if(!parse_occurrence(com_vec[2], occurrence)){
+        //number error, the same rules as locate_batch (00002 is a valid input)
         result = "ERROR: Invalid command";
         return;
     }
@@ -175,19 +450,21 @@ void CommandExecutor::handle_locate(vector<string> com_vec,string &result){
             return;
         }
     } 
-    if(!current_db){//if no files are loaded in
+    IndexVersion* db = current_db.load();
+    if(!db){//if no files are loaded in
         result = "No matching entry";
         return;
     } 
-    int ind = std::stoi(com_vec[2],nullptr,10);     //use the decimal(00002 is a valid input).
-    if(ind<=0){
-        result = "ERROR: Invalid command";
-        return;
-    }
-    if(!current_db){
-        return;
+    // The layers hold the locations in order, skip the ones before the layer of the occurrence;
+    for(const IndexVersion::Layer &layer : db->layers){
+        uint32_t count = layer.trie->count(com_vec[1]);
+        if(occurrence <= count){
+            layer.trie->search_with_loc(com_vec[1], static_cast<int>(occurrence), result);
+            return;
+        }
+        occurrence -= count;
     }
-    current_db->search_with_loc(com_vec[1], ind, result);   
+    result = "No matching entry";
     return;
 }
 
@@ -198,11 +475,9 @@ void CommandExecutor::handle_new(vector<string> com_vec,string &result){
         result = "ERROR: Invalid command";
         return;
     }
-    if(current_db){     // avoid delete a deleted pointer.
-        current_db->ReleaseMemory(current_db->root);
-        delete(current_db);
-        current_db = nullptr;
-    }
+    lock_guard<mutex> lock(writer);
+    publish(nullptr);
+    loaded_file.clear();
     return;
 }
 
@@ -213,11 +488,110 @@ void CommandExecutor::handle_end(vector<string> com_vec,string &result){
         result = "ERROR: Invalid command";
         return;
     }
-    if(current_db){     // avoid delete a deleted pointer.(dangling pointer)
-        current_db->ReleaseMemory(current_db->root);
-        delete(current_db);
-        current_db = nullptr;
+    lock_guard<mutex> lock(writer);
+    publish(nullptr);   // the old trie is freed once, after its last reader
+    loaded_file.clear();
+    return;
+}
+
+// Handle the save command: write the loaded trie to a snapshot file.
+// Input: com_vec: contains the command info. result: contains the result.
+void CommandExecutor::handle_save(vector<string> com_vec,string &result){
+    IndexVersion* db = current_db.load();
+    if(com_vec.size() != 2 || !db){
+        result = "ERROR: Invalid command";
+        return;
+    }
+    // A snapshot holds one trie, the layers are merged into a copy for it;
+    Trie merged;
+    const Trie* trie = db->layers[0].trie.get();
+    if(db->layers.size() > 1){
+        merged = trie->clone();
+        for(size_t l = 1; l < db->layers.size(); l++) merged.append_trie(*db->layers[l].trie);
+        trie = &merged;
+    }
+    if(!trie->save(com_vec[1])){
+        std::cerr << "Failed to write the snapshot: " << com_vec[1] << std::endl;
+        result = "ERROR: Invalid command";
+    }
+    return;
+}
+
+// Handle the open command: map a snapshot file written by save, the trie is
+// queried right on the mapping.
+// Input: com_vec: contains the command info. result: contains the result.
+void CommandExecutor::handle_open(vector<string> com_vec,string &result){
+    if(com_vec.size() != 2){
+        result = "ERROR: Invalid command";
+        return;
+    }
+    auto trie = make_shared<Trie>();
+    if(!trie->open(com_vec[1])){
+        std::cerr << "Failed to open the snapshot: " << com_vec[1] << std::endl;
+        result = "ERROR: Invalid command";
+        return;
+    }
+    lock_guard<mutex> lock(writer);
+    publish(single_layer(move(trie), 0));
+    loaded_file.clear();
+    return;
+}
+
+// Handle the prefix command: list the words that start with the prefix.
+// Input: com_vec: "prefix <prefix> [limit]". result: one "word count" line per word.
+void CommandExecutor::handle_prefix(vector<string> com_vec,string &result){
+    size_t limit;
+    if(com_vec.size() < 2 || com_vec.size() > 3 || !valid_word(com_vec[1]) || !parse_limit(com_vec, 2, limit)){
+        result = "ERROR: Invalid command";
+        return;
+    }
+    IndexVersion* db = current_db.load();
+    if(!db){
+        result = "No matching entry";
+        return;
+    }
+    collect_layers(*db, [&](const Trie &trie, const WordVisitor &visit){trie.scan_prefix(com_vec[1], visit);}, limit, result);
+    return;
+}
+
+// Handle the match command: list the words matching a pattern, '?' matches
+// one symbol and '*' any number of symbols.
+// Input: com_vec: "match <pattern> [limit]". result: one "word count" line per word.
+void CommandExecutor::handle_match(vector<string> com_vec,string &result){
+    size_t limit;
+    if(com_vec.size() < 2 || com_vec.size() > 3 || com_vec[1].size() > kMaxPattern || !parse_limit(com_vec, 2, limit)){
+        result = "ERROR: Invalid command";
+        return;
+    }
+    for(char c : com_vec[1]){
+        if(c == '?' || c == '*' || symbol_index(c) >= 0) continue;
+        result = "ERROR: Invalid command";
+        return;
+    }
+    IndexVersion* db = current_db.load();
+    if(!db){
+        result = "No matching entry";
+        return;
+    }
+    collect_layers(*db, [&](const Trie &trie, const WordVisitor &visit){trie.scan_pattern(com_vec[1], visit);}, limit, result);
+    return;
+}
+
+// Handle the range command: list the words between from and to, both included.
+// Input: com_vec: "range <from> <to> [limit]". result: one "word count" line per word.
+void CommandExecutor::handle_range(vector<string> com_vec,string &result){
+    size_t limit;
+    if(com_vec.size() < 3 || com_vec.size() > 4 || !valid_word(com_vec[1]) || !valid_word(com_vec[2])
+       || !parse_limit(com_vec, 3, limit)){
+        result = "ERROR: Invalid command";
+        return;
+    }
+    IndexVersion* db = current_db.load();
+    if(!db){
+        result = "No matching entry";
+        return;
     }
+    collect_layers(*db, [&](const Trie &trie, const WordVisitor &visit){trie.scan_range(com_vec[1], com_vec[2], visit);}, limit, result);
     return;
 }
 
@@ -13,7 +13,7 @@ function verify() {
 }
 # req_files=("src/tutorial/tutorial.cc" "src/include/tutorial/tutorial.h" )
 
-req_files=("src/tutorial/tutorial.cc" "src/include/tutorial/tutorial.h" "src/tutorial/trie.cc" "src/include/tutorial/trie.h")
+req_files=("src/tutorial/tutorial.cc" "src/include/tutorial/tutorial.h" "src/tutorial/trie.cc" "src/include/tutorial/trie.h" "src/tutorial/corpus.cc" "src/include/tutorial/corpus.h")
 verify "${req_files[@]}"	
 if [[ $? -ne 0 ]]; then
     exit 1
@@ -22,7 +22,7 @@ fi
 if [ $# -eq 1 ]
 then
 	#zip "${1}.zip" src/tutorial/tutorial.cc src/include/tutorial/tutorial.h REPORT.md
-	zip "${1}.zip" src/tutorial/tutorial.cc src/include/tutorial/tutorial.h src/tutorial/trie.cc src/include/tutorial/trie.h REPORT.md
+	zip "${1}.zip" src/tutorial/tutorial.cc src/include/tutorial/tutorial.h src/tutorial/trie.cc src/include/tutorial/trie.h src/tutorial/corpus.cc src/include/tutorial/corpus.h REPORT.md
 	
 else
 	echo 'Please provide a file name, eg ./submit Gaurav'
@@ -1,11 +1,20 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <thread>
 
+#include "tutorial/corpus.h"
 #include "tutorial/tutorial.h"
 
 
 namespace {
 
 using buzzdb::tutorial::CommandExecutor;
+using buzzdb::tutorial::Trie;
 
 
 using namespace std;
@@ -107,6 +116,335 @@ TEST(TestSuit, ShouldGiveInvalidResponseForAllInvalidQueries) {
             "ERROR: Invalid command");
 }
 
+TEST(TestSuit, OverflowingLocateNumberDoesNotPinReader) {
+  auto commandExecutor = std::make_shared<CommandExecutor>();
+  commandExecutor->execute("load data/sample.txt");
+  // Too large for an int, like in a batch.
+  EXPECT_EQ(commandExecutor->execute("locate song 99999999999"), "ERROR: Invalid command");
+  std::string batch_result;
+  commandExecutor->locate_batch("song 99999999999\n", batch_result);
+  EXPECT_EQ(batch_result, "ERROR: Invalid command\n");
+  // A reader left pinned would make the next publish wait forever. The
+  // commands run on a thread of their own, so a hang fails the test; the
+  // thread keeps the executor alive then.
+  auto done = std::make_shared<std::promise<std::string>>();
+  std::future<std::string> result = done->get_future();
+  std::thread([commandExecutor, done] {
+    commandExecutor->execute("new");
+    commandExecutor->execute("load data/sample.txt");
+    done->set_value(commandExecutor->execute("locate song 1"));
+  }).detach();
+  ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(10)));
+  EXPECT_EQ(result.get(), "3");
+}
+
+TEST(TutorialTest, ShouldAnswerBatchLikeSingleQueries) {
+  CommandExecutor commandExecutor;
+  std::string result;
+  commandExecutor.locate_batch("song 1\n", result);
+  EXPECT_EQ(result, "No matching entry\n");
+  commandExecutor.execute("load data/sample.txt");
+  result.clear();
+  commandExecutor.locate_batch(
+      "pie 2\n  SoNg   1 \nsong 1\npie 1\n\npie 3\nso#ng 1\npie\n"
+      "pie 1 2\nsong -1\nsong 0\nsong 0000001\nsongs 1\npi 1",
+      result);
+  EXPECT_EQ(result,
+            "21\n3\n3\n18\nNo matching entry\n"
+            "ERROR: Invalid command\nERROR: Invalid command\n"
+            "ERROR: Invalid command\nERROR: Invalid command\n"
+            "ERROR: Invalid command\n3\nNo matching entry\n"
+            "No matching entry\n");
+}
+
+TEST(TutorialTest, ShouldAnswerFromSavedSnapshot) {
+  CommandExecutor commandExecutor;
+  commandExecutor.execute("load data/sample.txt");
+  EXPECT_EQ(commandExecutor.execute("save sample.snapshot"), "");
+  commandExecutor.execute("new");
+  EXPECT_EQ(commandExecutor.execute("locate song 1"), "No matching entry");
+  EXPECT_EQ(commandExecutor.execute("open sample.snapshot"), "");
+  EXPECT_EQ(commandExecutor.execute("locate song 1"), "3");
+  EXPECT_EQ(commandExecutor.execute(" loCAte       pie        2 "), "21");
+  EXPECT_EQ(commandExecutor.execute(" locate       pie        3 "),
+            "No matching entry");
+  EXPECT_EQ(commandExecutor.execute("open data/sample.txt"),
+            "ERROR: Invalid command");
+  EXPECT_EQ(commandExecutor.execute("locate song 1"), "3");
+  std::remove("sample.snapshot");
+}
+
+TEST(TutorialTest, ShouldFindEveryLocationOfCompressedLists) {
+  Trie trie;
+  std::vector<int> dense;
+  std::vector<int> sparse;
+  int location = 0;
+  for (int i = 0; i < 100000; ++i) {
+    location += 1 + (i % 3);
+    dense.push_back(location);
+    trie.insert_with_loc("the", location);
+    if (i % 17 == 0) {
+      // Gaps that need every varint length.
+      sparse.push_back(location * (1 + i % 4096));
+    }
+  }
+  std::sort(sparse.begin(), sparse.end());
+  for (int value : sparse) trie.insert_with_loc("rare", value);
+  std::string result;
+  for (size_t i = 0; i < dense.size(); ++i) {
+    trie.search_with_loc("the", static_cast<int>(i + 1), result);
+    ASSERT_EQ(result, std::to_string(dense[i])) << i;
+  }
+  for (size_t i = 0; i < sparse.size(); ++i) {
+    trie.search_with_loc("rare", static_cast<int>(i + 1), result);
+    ASSERT_EQ(result, std::to_string(sparse[i])) << i;
+  }
+  trie.search_with_loc("the", static_cast<int>(dense.size() + 1), result);
+  EXPECT_EQ(result, "No matching entry");
+  // Less than a raw int per location, even with the slack of the arenas.
+  EXPECT_LT(trie.memory_usage(), (dense.size() + sparse.size()) * sizeof(int));
+}
+
+TEST(TutorialTest, ShouldFindLocationsOfLongListsAfterMerge) {
+  // Enough locations for dozens of full size chunks, so the lookup has to
+  // find the chunk in the directory. The list is built in a shard and merged,
+  // which relocates the directory.
+  std::vector<Trie> shards(buzzdb::tutorial::kAlphabetSize);
+  Trie& shard = shards[buzzdb::tutorial::symbol_index('w')];
+  int count = 3000000;
+  for (int i = 1; i <= count; ++i) shard.insert_with_loc("word", 2 * i);
+  shard.insert_with_loc("wide", 7);
+  Trie trie;
+  trie.merge_shards(shards, 2);
+  std::string result;
+  for (int i = 1; i <= count; i += 1 + i % 101) {
+    trie.search_with_loc("word", i, result);
+    ASSERT_EQ(result, std::to_string(2 * i)) << i;
+  }
+  trie.search_with_loc("word", count, result);
+  EXPECT_EQ(result, std::to_string(2 * count));
+  trie.search_with_loc("word", count + 1, result);
+  EXPECT_EQ(result, "No matching entry");
+  trie.search_with_loc("wide", 1, result);
+  EXPECT_EQ(result, "7");
+}
+
+TEST(TutorialTest, ShouldLoadInParallelLikeSequential) {
+  std::string text;
+  std::vector<std::string> words = {"the", "song", "Pie", "don't", "42", "x1", "tolstoy"};
+  for (size_t i = 0; i < 20000; ++i) {
+    text += words[(i * 7 + i / 3) % words.size()];
+    text += (i % 5 == 0) ? ",\n" : " ";
+  }
+  Trie sequential;
+  Trie parallel;
+  int next = buzzdb::tutorial::insert_words(sequential, text.data(), text.data() + text.size(), 1);
+  EXPECT_EQ(next, 20001);
+  EXPECT_EQ(buzzdb::tutorial::insert_words_parallel(parallel, text.data(), text.data() + text.size(), 1, 4),
+            next);
+  std::string expected;
+  std::string result;
+  for (const std::string& word : words) {
+    for (int n = 1; n <= 3000; n += 7) {
+      sequential.search_with_loc(word, n, expected);
+      parallel.search_with_loc(word, n, result);
+      EXPECT_EQ(expected, result) << word << " " << n;
+    }
+  }
+  EXPECT_TRUE(parallel.startsWith("tol"));
+  EXPECT_FALSE(parallel.search("tol"));
+}
+
+TEST(TutorialTest, ShouldScanWordsInOrder) {
+  std::vector<std::string> words = {"a",  "ab",   "abc",  "abd", "b",  "ba",
+                                    "b'", "b1",   "b10",  "bab", "c",  "can't",
+                                    "cat", "cats", "dog", "do",  "x9", "zz"};
+  Trie trie;
+  int index = 1;
+  for (const std::string& word : words) {
+    for (int n = 0; n <= static_cast<int>(word.size()); n++) trie.insert_with_loc(word, index++);
+  }
+  std::vector<std::string> sorted = words;
+  std::sort(sorted.begin(), sorted.end());
+  auto scan = [](auto&& run) {
+    std::vector<std::string> found;
+    run([&](std::string_view word, uint32_t count) {
+      found.emplace_back(word);
+      EXPECT_EQ(count, word.size() + 1);
+      return true;
+    });
+    return found;
+  };
+  auto filter = [&](auto&& keep) {
+    std::vector<std::string> expected;
+    for (const std::string& word : sorted) {
+      if (keep(word)) expected.push_back(word);
+    }
+    return expected;
+  };
+  for (std::string prefix : {"", "a", "ab", "b", "b1", "ca", "cat", "e", "abcd"}) {
+    EXPECT_EQ(scan([&](auto&& visit) { trie.scan_prefix(prefix, visit); }),
+              filter([&](const std::string& w) { return w.compare(0, prefix.size(), prefix) == 0; }))
+        << prefix;
+  }
+  EXPECT_EQ(scan([&](auto&& visit) { trie.scan_pattern("*", visit); }), sorted);
+  EXPECT_EQ(scan([&](auto&& visit) { trie.scan_pattern("?a*", visit); }),
+            std::vector<std::string>({"ba", "bab", "can't", "cat", "cats"}));
+  EXPECT_EQ(scan([&](auto&& visit) { trie.scan_pattern("*b*", visit); }),
+            filter([](const std::string& w) { return w.find('b') != std::string::npos; }));
+  EXPECT_EQ(scan([&](auto&& visit) { trie.scan_pattern("**t", visit); }),
+            std::vector<std::string>({"can't", "cat"}));
+  EXPECT_EQ(scan([&](auto&& visit) { trie.scan_pattern("b?", visit); }),
+            std::vector<std::string>({"b'", "b1", "ba"}));
+  EXPECT_TRUE(scan([&](auto&& visit) { trie.scan_pattern("a#", visit); }).empty());
+  for (auto [from, to] : std::vector<std::pair<std::string, std::string>>{
+           {"a", "zz"}, {"ab", "b1"}, {"aa", "bz"}, {"abc", "abc"}, {"b0", "cat"}, {"d", "a"}, {"dp", "zzz"}}) {
+    EXPECT_EQ(scan([&](auto&& visit) { trie.scan_range(from, to, visit); }),
+              filter([&](const std::string& w) { return from <= w && w <= to; }))
+        << from << " " << to;
+  }
+
+  CommandExecutor commandExecutor;
+  commandExecutor.execute("load data/sample.txt");
+  EXPECT_EQ(commandExecutor.execute("prefix pi"), "pie 2");
+  EXPECT_EQ(commandExecutor.execute("match p?e"), "pie 2");
+  EXPECT_EQ(commandExecutor.execute("range pie pie"), "pie 2");
+  EXPECT_EQ(commandExecutor.execute("prefix qqqq"), "No matching entry");
+  EXPECT_EQ(commandExecutor.execute("prefix a 0"), "ERROR: Invalid command");
+  EXPECT_EQ(commandExecutor.execute("match a#"), "ERROR: Invalid command");
+  EXPECT_EQ(commandExecutor.execute("range a"), "ERROR: Invalid command");
+  std::string listed = commandExecutor.execute("match * 3");
+  EXPECT_EQ(std::count(listed.begin(), listed.end(), '\n'), 2);
+}
+
+TEST(TutorialTest, ShouldLoadLastWordWithoutNewline) {
+  std::string filename = "tutorial_test_no_newline.txt";
+  std::ofstream(filename, std::ios::trunc) << "hello world";
+  CommandExecutor commandExecutor;
+  commandExecutor.execute("load " + filename);
+  EXPECT_EQ(commandExecutor.execute("locate world 1"), "2");
+  EXPECT_EQ(commandExecutor.execute("prefix w"), "world 1");
+  // The same for a file that is read block by block;
+  Trie trie;
+  ASSERT_TRUE(buzzdb::tutorial::load_file_streamed(filename, trie));
+  std::string result;
+  trie.search_with_loc("world", 1, result);
+  EXPECT_EQ(result, "2");
+  std::remove(filename.c_str());
+}
+
+TEST(TutorialTest, ShouldAppendGrowingFiles) {
+  std::string filename = "tutorial_test_append.txt";
+  auto write = [&](const std::string& text, std::ios::openmode mode) {
+    std::ofstream out(filename, mode);
+    out << text;
+  };
+  write("log one\nlog two\n", std::ios::trunc);
+  CommandExecutor commandExecutor;
+  commandExecutor.execute("append " + filename);
+  EXPECT_EQ(commandExecutor.execute("locate log 2"), "3");
+  EXPECT_EQ(commandExecutor.execute("locate three 1"), "No matching entry");
+  // A word without a separator may still be written, it is replaced once it grows;
+  write("log three\nlog fo", std::ios::app);
+  commandExecutor.execute("append " + filename);
+  EXPECT_EQ(commandExecutor.execute("locate three 1"), "6");
+  EXPECT_EQ(commandExecutor.execute("locate fo 1"), "8");
+  write("ur\n", std::ios::app);
+  commandExecutor.execute("append " + filename);
+  EXPECT_EQ(commandExecutor.execute("locate four 1"), "8");
+  EXPECT_EQ(commandExecutor.execute("locate fo 1"), "No matching entry");
+  EXPECT_EQ(commandExecutor.execute("locate log 4"), "7");
+  // A truncated file is loaded again;
+  write("two\n", std::ios::trunc);
+  commandExecutor.execute("append " + filename);
+  EXPECT_EQ(commandExecutor.execute("locate two 1"), "1");
+  EXPECT_EQ(commandExecutor.execute("locate log 1"), "No matching entry");
+  EXPECT_EQ(commandExecutor.execute("append"), "ERROR: Invalid command");
+  // A word that grows after a load is replaced as well;
+  write("log one\nlog fo", std::ios::trunc);
+  commandExecutor.execute("load " + filename);
+  EXPECT_EQ(commandExecutor.execute("locate fo 1"), "4");
+  write("u", std::ios::app);
+  commandExecutor.execute("append " + filename);
+  EXPECT_EQ(commandExecutor.execute("locate fou 1"), "4");
+  write("r five", std::ios::app);
+  commandExecutor.execute("append " + filename);
+  EXPECT_EQ(commandExecutor.execute("locate four 1"), "4");
+  EXPECT_EQ(commandExecutor.execute("locate five 1"), "5");
+  EXPECT_EQ(commandExecutor.execute("locate fo 1"), "No matching entry");
+  EXPECT_EQ(commandExecutor.execute("locate fou 1"), "No matching entry");
+  EXPECT_EQ(commandExecutor.execute("locate ur 1"), "No matching entry");
+  EXPECT_EQ(commandExecutor.execute("prefix f"), "five 1\nfour 1");
+  std::remove(filename.c_str());
+}
+
+TEST(TutorialTest, ShouldAppendLikeLoad) {
+  // Many appends of different sizes leave the words in several layers, every
+  // query has to answer as if the whole file was loaded at once.
+  std::string filename = "tutorial_test_layers.txt";
+  std::vector<std::string> words = {"the", "then", "song", "pie", "x1", "don't", "sing"};
+  std::ofstream(filename, std::ios::trunc) << "the song\n";
+  CommandExecutor appended;
+  appended.execute("load " + filename);
+  size_t next = 0;
+  for (int round = 1; round <= 40; ++round) {
+    std::ofstream out(filename, std::ios::app);
+    for (int i = 0; i < (round % 7) * round; ++i, ++next) {
+      out << words[(next * 5 + next / 3) % words.size()] << (i % 4 ? " " : "\n");
+    }
+    out << "\n";
+    out.close();
+    appended.execute("append " + filename);
+  }
+  CommandExecutor loaded;
+  loaded.execute("load " + filename);
+  std::string batch;
+  for (const std::string& word : words) {
+    for (int n = 1; n <= 400; n += 3) {
+      std::string query = "locate " + word + " " + std::to_string(n);
+      ASSERT_EQ(appended.execute(query), loaded.execute(query)) << query;
+      batch += word + " " + std::to_string(n) + "\n";
+    }
+  }
+  std::string expected, result;
+  loaded.locate_batch(batch, expected);
+  appended.locate_batch(batch, result);
+  EXPECT_EQ(expected, result);
+  for (std::string query : {"prefix th", "prefix s 2", "match *i*", "range pie then", "match ? 1"}) {
+    EXPECT_EQ(appended.execute(query), loaded.execute(query)) << query;
+  }
+  appended.execute("save " + filename + ".snapshot");
+  CommandExecutor opened;
+  opened.execute("open " + filename + ".snapshot");
+  EXPECT_EQ(opened.execute("locate sing 200"), loaded.execute("locate sing 200"));
+  EXPECT_EQ(opened.execute("match *"), loaded.execute("match *"));
+  std::remove((filename + ".snapshot").c_str());
+  std::remove(filename.c_str());
+}
+
+TEST(TutorialTest, ShouldAnswerQueriesDuringReload) {
+  CommandExecutor commandExecutor;
+  commandExecutor.execute("load data/sample.txt");
+  std::atomic<bool> done{false};
+  std::thread loader([&] {
+    for (int i = 0; i < 200; i++) {
+      commandExecutor.execute(i % 2 ? "load data/sample.txt" : "append data/sample.txt");
+    }
+    done = true;
+  });
+  std::string batch = "song 1\npie 2\n";
+  while (!done) {
+    EXPECT_EQ(commandExecutor.execute("locate song 1"), "3");
+    EXPECT_EQ(commandExecutor.execute("prefix pi"), "pie 2");
+    std::string result;
+    commandExecutor.locate_batch(batch, result);
+    EXPECT_EQ(result, "3\n21\n");
+  }
+  loader.join();
+  commandExecutor.execute("new");
+  EXPECT_EQ(commandExecutor.execute("locate song 1"), "No matching entry");
+}
+
 }  // namespace
 
 int main(int argc, char* argv[]) {
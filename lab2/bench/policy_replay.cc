@@ -0,0 +1,205 @@
+// Replays page access traces against the replacement policies of the buffer
+// manager and reports hit ratio and throughput of each.
+//
+// Usage: policy_replay [options] [trace file]
+//   --frames=<n>     frames of the buffer (1000)
+//   --pages=<n>      distinct pages of the generated traces (10000)
+//   --accesses=<n>   accesses of the generated traces (1000000)
+//   --page-size=<n>  page size of the throughput runs (4096)
+// A trace file has one access per line: the page id, followed by " w" for a
+// write. Without a trace file, synthetic traces are generated:
+//   zipf      Zipfian accesses (skew 1.0), a few pages are hot
+//   scan      the Zipfian accesses, with a scan of all pages every 100000
+//   loop      the pages of a loop slightly larger than the buffer, in order
+//
+// The hit ratio is simulated with the policy alone. The throughput replays
+// the trace through fix_page/unfix_page of a BufferManager, which reads and
+// writes the segment files in the working directory.
+//
+// Build (from lab2):
+//   g++ -std=c++17 -O2 -pthread -Isrc/include src/buffer/*.cc src/storage/posix_file.cc bench/policy_replay.cc -o policy_replay
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "buffer/buffer_manager.h"
+#include "buffer/replacement_policy.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  size_t frames = 1000;
+  size_t pages = 10000;
+  size_t accesses = 1000000;
+  size_t page_size = 4096;
+  std::string filename;
+};
+
+struct Access {
+  uint64_t page_id;
+  bool write;
+};
+
+struct Trace {
+  std::string name;
+  std::vector<Access> accesses;
+};
+
+const std::pair<const char*, buzzdb::PolicyType> kPolicies[] = {
+    {"2Q", buzzdb::TWO_QUEUE},
+    {"CLOCK", buzzdb::CLOCK},
+    {"LRU-2", buzzdb::LRU_K},
+    {"ARC", buzzdb::ARC},
+};
+
+/// Reads a trace file, returns false if it can not be read.
+bool read_trace(const std::string& filename, Trace& trace) {
+  std::ifstream input(filename);
+  if (!input) return false;
+  trace.name = filename;
+  std::string line;
+  while (std::getline(input, line)) {
+    if (line.empty()) continue;
+    size_t end = 0;
+    uint64_t page_id = std::stoull(line, &end);
+    bool write = line.find('w', end) != std::string::npos;
+    trace.accesses.push_back({page_id, write});
+  }
+  return true;
+}
+
+/// Every tenth access is a write.
+std::vector<Trace> make_traces(const Options& options) {
+  std::mt19937_64 engine{42};
+  std::vector<double> weights(options.pages);
+  for (size_t rank = 0; rank < options.pages; ++rank) {
+    weights[rank] = 1.0 / std::pow(rank + 1.0, 1.0);
+  }
+  std::discrete_distribution<uint64_t> zipf(weights.begin(), weights.end());
+  std::vector<Trace> traces(3);
+  traces[0].name = "zipf";
+  traces[1].name = "scan";
+  traces[2].name = "loop";
+  size_t loop = options.frames + options.frames / 10 + 1;
+  for (size_t i = 0; i < options.accesses; ++i) {
+    bool write = i % 10 == 0;
+    uint64_t hot = zipf(engine);
+    traces[0].accesses.push_back({hot, write});
+    if (i % 100000 == 0) {
+      for (uint64_t page_id = 0; page_id < options.pages; ++page_id) {
+        traces[1].accesses.push_back({page_id, false});
+      }
+    }
+    traces[1].accesses.push_back({hot, write});
+    traces[2].accesses.push_back({i % loop, write});
+  }
+  return traces;
+}
+
+/// Replays the trace against the policy alone and returns the hit ratio.
+double simulate(buzzdb::PolicyType type, size_t frame_count, const Trace& trace) {
+  auto policy = buzzdb::ReplacementPolicy::make(type, frame_count);
+  std::unordered_map<uint64_t, uint32_t> frames;
+  std::vector<uint64_t> page_of(frame_count);
+  uint32_t free_frames = static_cast<uint32_t>(frame_count);
+  size_t hits = 0;
+  auto take = [](uint32_t) { return buzzdb::TAKE; };
+  for (const Access& access : trace.accesses) {
+    auto it = frames.find(access.page_id);
+    if (it != frames.end()) {
+      policy->access(it->second);
+      ++hits;
+      continue;
+    }
+    uint32_t frame;
+    if (free_frames > 0) {
+      frame = --free_frames;
+    } else {
+      frame = policy->victim(take);
+      frames.erase(page_of[frame]);
+    }
+    page_of[frame] = access.page_id;
+    frames[access.page_id] = frame;
+    policy->insert(frame, access.page_id);
+  }
+  return static_cast<double>(hits) / trace.accesses.size();
+}
+
+/// Replays the trace through a BufferManager and returns accesses per second.
+double replay(buzzdb::PolicyType type, const Options& options, const Trace& trace) {
+  buzzdb::BufferManager buffer_manager{options.page_size, options.frames, false, false, type};
+  auto start = Clock::now();
+  for (const Access& access : trace.accesses) {
+    auto& page = buffer_manager.fix_page(access.page_id, access.write);
+    if (access.write) ++page.get_data()[0];
+    buffer_manager.unfix_page(page, access.write);
+  }
+  return trace.accesses.size() / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/// Parses `--name=value` options, the first other argument is the trace file.
+bool parse_options(int argc, char* argv[], Options& options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg.substr(0, 2) != "--") {
+      options.filename = argv[i];
+      continue;
+    }
+    size_t equals = arg.find('=');
+    if (equals == std::string_view::npos) return false;
+    std::string_view name = arg.substr(2, equals - 2);
+    size_t value = std::stoul(std::string(arg.substr(equals + 1)));
+    if (name == "frames") options.frames = std::max<size_t>(value, 1);
+    else if (name == "pages") options.pages = std::max<size_t>(value, 1);
+    else if (name == "accesses") options.accesses = value;
+    else if (name == "page-size") options.page_size = std::max<size_t>(value, 8);
+    else return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    std::fprintf(stderr,
+                 "usage: %s [--frames=n] [--pages=n] [--accesses=n] [--page-size=n] [trace file]\n",
+                 argv[0]);
+    return 1;
+  }
+  std::vector<Trace> traces;
+  bool generated = options.filename.empty();
+  if (generated) {
+    traces = make_traces(options);
+  } else {
+    traces.emplace_back();
+    if (!read_trace(options.filename, traces[0])) {
+      std::fprintf(stderr, "can not read %s\n", options.filename.c_str());
+      return 1;
+    }
+  }
+  std::printf("%zu frames of %zu bytes\n", options.frames, options.page_size);
+  std::printf("%-10s %-6s %10s %16s\n", "trace", "policy", "hit ratio", "accesses/s");
+  for (const Trace& trace : traces) {
+    for (auto& [name, type] : kPolicies) {
+      double hit_ratio = simulate(type, options.frames, trace);
+      double throughput = replay(type, options, trace);
+      std::printf("%-10s %-6s %9.2f%% %16.0f\n", trace.name.c_str(), name, 100 * hit_ratio,
+                  throughput);
+    }
+  }
+  // The generated traces only use segment 0.
+  if (generated) std::remove("0");
+  return 0;
+}
@@ -1,11 +1,17 @@
 
+#include <sys/mman.h>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <memory>
 #include <vector>
 #include <algorithm>
+#include <cmath>
+#include <tuple>
+#include <stdexcept>
 #include "buffer/buffer_manager.h"
+#include "common/defer.h"
 #include "common/macros.h"
 #include "storage/file.h"
 
@@ -14,309 +20,866 @@ using namespace std;
 
 namespace buzzdb {
 
-BufferFrame::BufferFrame(uint64_t page_id, bool exclusive, unique_ptr<char[]>&& data_array):
-page_id(page_id),
-segment(static_cast<uint16_t>(page_id >> 48)),
-segment_id((page_id<<16)>>16),
-data_array(move(data_array)),
+BufferFrame::BufferFrame():
+page_id(0),
+segment(0),
+segment_id(0),
+data(nullptr),
 dirty(false),
 fixed(0),
-fifo(true)
-{
-    if(exclusive) type = EXCLUSIVE;
-    else type = SHARE;
-}
+next(kNoFrame),
+owner(),
+prefetch(NOT_PREFETCHED),
+lsn(0),
+rec_lsn(0)
+{}
 
 // Get data from Bufferframe
 char* BufferFrame::get_data() {
     // Add lock here
-    return data_array.get();
+    return data;
 }
 
-// Constructor of Linked_BufferFrame
-Linked_BufferFrame::Linked_BufferFrame(shared_ptr<BufferFrame>& page_ptr):
-page_ptr(page_ptr),next(nullptr),prev(nullptr){}
-
-// Constructor of BufferManager
-BufferManager::BufferManager(size_t page_size, size_t page_count):
-hash_table(),   // Nothing in the hash_table
-fifo_head(nullptr),
-fifo_tail(nullptr),
-lru_head(nullptr),
-lru_tail(nullptr),
+// Constructor of BufferManager, all frames are allocated here and start in
+// the free list;
+BufferManager::BufferManager(size_t page_size, size_t page_count, bool async_io, bool direct_io, PolicyType policy_type, const string& log_file):
+policy(ReplacementPolicy::make(policy_type, page_count)),
+free_head(page_count ? 0 : kNoFrame),
 page_count(page_count),
 page_size(page_size),
-page_num(0){}
+region(nullptr),
+region_size(page_count * page_size + kHugePage),
+pool(nullptr),
+frames(make_unique<BufferFrame[]>(page_count)),
+async_io(async_io),
+direct_io(direct_io),
+pending_io(0),
+frame_waiters(0),
+unfix_epoch(0),
+stop_cleaner(false),
+read_ahead(0),
+stop_prefetcher(false),
+stats_out(nullptr),
+stats_interval(0),
+stop_checkpointer(false){
+    if(direct_io && page_size % kDirectAlignment != 0){
+        throw std::invalid_argument("page size is not aligned for direct I/O");
+    }
+    // Map one huge page more than needed to align the pool to a huge page;
+    region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) throw std::bad_alloc();
+    uintptr_t start = (reinterpret_cast<uintptr_t>(region) + kHugePage - 1) & ~(uintptr_t(kHugePage) - 1);
+    pool = reinterpret_cast<char*>(start);
+    madvise(pool, page_count * page_size, MADV_HUGEPAGE);   // Only a hint, fine if it fails
+    for(size_t i = 0; i < page_count; i++){
+        frames[i].data = pool + i * page_size;
+        frames[i].next = (i + 1 < page_count) ? static_cast<uint32_t>(i + 1) : kNoFrame;
+    }
+    // A partition holds about page_count / kPartitions pages, reserve room so
+    // the tables are not rehashed on a miss;
+    for(PageTablePartition& partition : partitions) partition.pages.reserve(page_count / kPartitions + 1);
+    // Redo the logged changes before anybody fixes a page. The pages are
+    // written back like any other change;
+    if(!log_file.empty()){
+        log = make_unique<LogManager>(log_file);
+        log->recover([this](uint64_t lsn, uint64_t page_id, uint32_t offset, const char* data, uint32_t size){
+            if(size_t(offset) + size > this->page_size) throw std::runtime_error("log record does not fit in a page");
+            BufferFrame& page = fix_page(page_id, true);
+            memcpy(page.data + offset, data, size);
+            page.lsn = lsn;
+            if(page.rec_lsn == 0) page.rec_lsn = lsn - sizeof(LogRecordHeader) - size;
+            unfix_page(page, true);
+        });
+    }
+    cleaner = thread(&BufferManager::clean_pages, this);
+    prefetcher = thread(&BufferManager::prefetch_loop, this);
+    if(log) checkpointer = thread(&BufferManager::checkpoint_loop, this);
+}
 
 // Deallocator of BufferManager
 BufferManager::~BufferManager() {
-    // Write back all pages inside buffer;
-    hash_table.clear();
-    shared_ptr<Linked_BufferFrame> ptr = fifo_head;
-    shared_ptr<Linked_BufferFrame> temp;
-    while(ptr){
-        write_back_page(ptr);
-        temp = ptr;
-        ptr = ptr->next;
-        if(temp->next)temp->next.reset();
-        if(temp->prev) temp->prev.reset();
-        if(temp) temp.reset();
-    }
-    ptr= lru_head;
-    while(ptr){
-        write_back_page(ptr);
-        temp = ptr;
-        ptr = ptr->next;
-        if(temp->next)temp->next.reset();
-        if(temp->prev) temp->prev.reset();
-        if(temp) temp.reset();
-    }
-}
-
-// Insert page to a linked list.
-void BufferManager::insert_page(shared_ptr<Linked_BufferFrame>& head, shared_ptr<Linked_BufferFrame> list_ptr, bool fifo){
-    shared_ptr<Linked_BufferFrame>& tail = (fifo) ? fifo_tail : lru_tail;
-    if(head == nullptr){
-        head = list_ptr;
-        tail = list_ptr;
-        list_ptr->next = nullptr;
-        list_ptr->prev = nullptr;
-    }
-    else{
-        list_ptr->next = head;
-        list_ptr->prev = nullptr;
-        head->prev = list_ptr;
-        head = list_ptr;
-    }
-    if(fifo) fifo_vec.push_back(list_ptr->page_ptr->page_id);
-    else{
-        // Insert into lru set fifo to false
-        lru_vec.push_back(list_ptr->page_ptr->page_id);
-        list_ptr->page_ptr->fifo = false;
-    }
-    page_num++; // Add page_num
-    hash_table[list_ptr->page_ptr->page_id] = list_ptr; // Insert id into hash_table
-    list_ptr->page_ptr->fixed++;
+    if(checkpointer.joinable()){
+        {
+        unique_lock<mutex> my_lock(checkpointer_mtx);
+        stop_checkpointer = true;
+        }
+        checkpointer_cv.notify_one();
+        checkpointer.join();
+    }
+    {
+    unique_lock<mutex> my_lock(cleaner_mtx);
+    stop_cleaner = true;
+    }
+    cleaner_cv.notify_one();
+    cleaner.join();
+    {
+    unique_lock<mutex> my_lock(prefetch_mtx);
+    stop_prefetcher = true;
+    }
+    prefetch_cv.notify_one();
+    prefetcher.join();
+    // Write back all dirty pages inside buffer, a frame without a page is
+    // never dirty;
+    for(size_t frame = 0; frame < page_count; frame++){
+        if(frames[frame].dirty) write_back_page(frames[frame]);
+    }
+    if(direct_io || log){
+        for(auto& [segment, file] : segment_files) file->sync();
+    }
+    // All changes are in the segment files, nothing is left to redo;
+    if(log) log->truncate();
+    munmap(region, region_size);
+}
+
+void BufferManager::write_back_page(BufferFrame& frame){
+    if(log) log->flush(frame.lsn);     // Write-ahead
+    size_t offset = frame.segment_id * page_size;
+    auto start = chrono::steady_clock::now();
+    segment_file(frame.segment).write_block(frame.data, offset, page_size);// Write to the disk
+    frame.rec_lsn = 0;
+    StatSlot& slot = local_stats();
+    slot.write_backs.fetch_add(1, memory_order_relaxed);
+    record_latency(slot.write_latency, start);
     return;
 }
 
-// Delete page from a linked list;
-void BufferManager::delete_page(shared_ptr<Linked_BufferFrame>& head, shared_ptr<Linked_BufferFrame> list_ptr, bool fifo){
-    uint64_t page_id = list_ptr->page_ptr->page_id;
-    shared_ptr<Linked_BufferFrame>& tail = (fifo) ? fifo_tail : lru_tail;
-    if (!head || !list_ptr) {
-        return; // Nothing to delete.
+void BufferManager::read_disk_file(uint64_t page_id, char* data){
+    size_t offset = get_segment_page_id(page_id) * page_size;
+    auto start = chrono::steady_clock::now();
+    segment_file(get_segment_id(page_id)).read_block(offset, page_size, data);
+    record_latency(local_stats().read_latency, start);
+    return;
+}
+
+// Threads take the slots in turn, a thread keeps its slot;
+StatSlot& BufferManager::local_stats(){
+    static atomic<uint32_t> next_slot{0};
+    thread_local uint32_t slot = next_slot.fetch_add(1, memory_order_relaxed) % kStatSlots;
+    return stats[slot];
+}
+
+void BufferManager::record_latency(atomic<uint64_t> (&buckets)[kLatencyBuckets], chrono::steady_clock::time_point start){
+    uint64_t us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    size_t bucket = 0;
+    while(bucket + 1 < kLatencyBuckets && (us >> bucket) != 0) bucket++;
+    buckets[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+// Open the file of a segment once, the files are thread-safe for reads and
+// writes of blocks, so only the lookup needs file_mtx;
+File& BufferManager::segment_file(uint16_t segment){
+    unique_lock<mutex> my_lock(file_mtx);
+    unique_ptr<File>& file = segment_files[segment];
+    if(!file){
+        string segment_str = std::to_string(segment);
+        if(async_io){
+            file = File::open_uring_file(segment_str.c_str(), File::WRITE, 64, direct_io, !log);
+            file->register_buffer(pool, page_count * page_size);
+        }
+        else file = File::open_file(segment_str.c_str(), File::WRITE, direct_io, !log);
+    }
+    return *file;
+}
+
+PageTablePartition& BufferManager::partition_of(uint64_t page_id){
+    // Fibonacci hashing, consecutive pages of a segment go to different partitions;
+    return partitions[(page_id * 0x9E3779B97F4A7C15ull) >> (64 - kPartitionBits)];
+}
+
+// Find page in the page table and fix it under the partition latch, so it
+// can not be evicted any more once it is found;
+uint32_t BufferManager::find_page(PageTablePartition& partition, uint64_t page_id){
+    unique_lock<mutex> my_lock(partition.mtx);
+    auto it = partition.pages.find(page_id);
+    if(it == partition.pages.end()) return kNoFrame;
+    frames[it->second].fixed++;
+    return it->second;
+}
+
+// The page is fixed, move it in the 2Q lists and lock it;
+BufferFrame* BufferManager::use_page(uint32_t frame, uint64_t page_id, LockType type){
+    BufferFrame& page = frames[frame];
+    // Only the first fix of a prefetched page writes the flag;
+    uint8_t prefetch = page.prefetch.load(memory_order_relaxed) ? page.prefetch.exchange(NOT_PREFETCHED) : uint8_t{NOT_PREFETCHED};
+    if(prefetch == PREFETCH_TRIGGER){
+        // The scan reached the current window, read the next one;
+        size_t window = min(read_ahead.load(), page_count / 4);
+        if(window > 0) request_prefetch(page_id + window, window, true);
     }
-    if (head == list_ptr) {
-        head = list_ptr->next; // Update the head to the next node.
-        if (head) {
-            head->prev.reset(); // Clear the previous pointer of the new head.
+    // The first fix of a prefetched page is its first access, the policy
+    // saw it when the page was read;
+    if(prefetch == NOT_PREFETCHED){
+        bool promoted;
+        if(policy->lock_free_access()) promoted = policy->access(frame);
+        else{
+            unique_lock<mutex> my_lock(list_mtx);
+            promoted = policy->access(frame);
         }
-        else tail.reset();
+        if(promoted) local_stats().promotions.fetch_add(1, memory_order_relaxed);
     }
-    else{
-        if (list_ptr->prev) {
-            list_ptr->prev->next = list_ptr->next; // Update the next pointer of the previous node.
+    if(type == OPTIMISTIC) return &page;
+    bool exclusive = type == EXCLUSIVE;
+    // The page is not fixed while the latch is awaited, the buffer should not
+    // look full because of waiting threads. The frame may be given to another
+    // page meanwhile, which can not be published while the latch is held;
+    if(!(exclusive ? page.latch.try_lock() : page.latch.try_lock_shared())){
+        unfix_frame(page);
+        auto start = chrono::steady_clock::now();
+        if(exclusive) page.latch.lock();
+        else page.latch.lock_shared();
+        StatSlot& slot = local_stats();
+        slot.latch_waits.fetch_add(1, memory_order_relaxed);
+        slot.latch_wait_ns.fetch_add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(), memory_order_relaxed);
+        PageTablePartition& partition = partition_of(page_id);
+        unique_lock<mutex> my_lock(partition.mtx);
+        auto it = partition.pages.find(page_id);
+        if(it == partition.pages.end() || it->second != frame){
+            if(exclusive) page.latch.unlock();
+            else page.latch.unlock_shared();
+            return nullptr;
+        }
+        page.fixed++;
+    }
+    if(exclusive) page.owner = this_thread::get_id();
+    return &page;
+}
+
+// Select page to move out in the order of the policy. list_mtx is held,
+// the partition latch of the page is taken to check that nobody fixed it in
+// the meantime;
+uint32_t BufferManager::victim_page(uint32_t& dirty_frame){
+    return policy->victim([&](uint32_t frame){
+        BufferFrame& page = frames[frame];
+        if(page.fixed != 0) return SKIP;
+        PageTablePartition& partition = partition_of(page.page_id);
+        unique_lock<mutex> my_lock(partition.mtx);
+        if(page.fixed != 0) return SKIP;
+        if(page.dirty){
+            // Keep the page in the buffer until it is written, a fix
+            // of it must not read the old version from disk;
+            page.fixed++;
+            page.dirty = false;
+            dirty_frame = frame;
+            return STOP;
         }
-        else {
-            // If there is no previous node, list_ptr is the new head.
-            head = list_ptr->next;
-            if (head) {
-                head->prev.reset();
+        // Remove key from the hash table, a page whose read ahead
+        // failed is not in it any more;
+        auto it = partition.pages.find(page.page_id);
+        if(it != partition.pages.end() && it->second == frame) partition.pages.erase(it);
+        local_stats().evictions.fetch_add(1, memory_order_relaxed);
+        return TAKE;
+    });
+}
+
+// Make room for the new page. A free frame is used first, otherwise the
+// policy picks a victim;
+uint32_t BufferManager::reserve_frame(uint64_t page_id){
+    for(size_t retries = 0; ; retries++){
+        uint32_t dirty_frame = kNoFrame;
+        {
+        unique_lock<mutex> my_lock(list_mtx);
+        uint32_t frame = free_head;
+        if(frame != kNoFrame) free_head = frames[frame].next;
+        else{
+            frame = victim_page(dirty_frame);
+        }
+        if(frame != kNoFrame){
+            BufferFrame& page = frames[frame];
+            page.page_id = page_id;
+            page.segment = get_segment_id(page_id);
+            page.segment_id = get_segment_page_id(page_id);
+            page.dirty = false;
+            page.fixed = 1;
+            page.prefetch = NOT_PREFETCHED;
+            page.lsn = 0;
+            page.rec_lsn = 0;
+            policy->insert(frame, page_id);
+            pending_io++;
+            return frame;
+        }
+        if(dirty_frame != kNoFrame) pending_io++;
+        else if(pending_io == 0 && retries >= kFullRetries) return kNoFrame;     // No page can victim;
+        }
+        if(dirty_frame == kNoFrame){
+            this_thread::yield();
+            continue;
+        }
+        cleaner_cv.notify_one();   // The cleaner is behind, let it catch up
+        // If dirty, need to write back to disk, then look again. A writer that
+        // fixed the page in the meantime may be waiting for this write back
+        // to find a victim itself, so the page is left to it then;
+        BufferFrame& victim = frames[dirty_frame];
+        if(victim.latch.try_lock_shared()){
+            try{
+                write_back_page(victim);
+            }
+            catch(const std::exception&){
+                // The page stays dirty and is given back, the miss gets the error;
+                victim.dirty = true;
+                victim.latch.unlock_shared();
+                unfix_frame(victim);
+                pending_io--;
+                throw;
+            }
+            victim.latch.unlock_shared();
+        }
+        else victim.dirty = true;
+        unfix_frame(victim);
+        pending_io--;
+    }
+}
+
+// Wake up every kCleanInterval, or when a miss found a dirty victim, and
+// write back the dirty pages that are close to eviction;
+void BufferManager::clean_pages(){
+    vector<uint32_t> batch;
+    batch.reserve(2 * kCleanBatch);
+    auto dumped = chrono::steady_clock::now();
+    unique_lock<mutex> my_lock(cleaner_mtx);
+    while(!stop_cleaner){
+        cleaner_cv.wait_for(my_lock, kCleanInterval);
+        if(stop_cleaner) break;
+        if(stats_out && stats_interval.count() > 0 && chrono::steady_clock::now() - dumped >= stats_interval){
+            get_stats().print(*stats_out);
+            dumped = chrono::steady_clock::now();
+        }
+        my_lock.unlock();
+        {
+        unique_lock<mutex> list_lock(list_mtx);
+        collect_dirty(batch);
+        }
+        write_batch(batch);
+        my_lock.lock();
+    }
+}
+
+// Same checks as victim_page, the pages stay fixed until they are written,
+// and count as pending I/O so that a miss waits for them;
+void BufferManager::collect_dirty(vector<uint32_t>& batch){
+    vector<uint32_t> candidates;
+    policy->candidates(kCleanBatch, candidates);
+    for(uint32_t frame : candidates) collect_page(frame, batch);
+}
+
+void BufferManager::collect_page(uint32_t frame, vector<uint32_t>& batch){
+    BufferFrame& page = frames[frame];
+    if(page.fixed != 0 || !page.dirty) return;
+    PageTablePartition& partition = partition_of(page.page_id);
+    unique_lock<mutex> my_lock(partition.mtx);
+    if(page.fixed != 0 || !page.dirty) return;
+    page.fixed++;
+    page.dirty = false;
+    pending_io++;
+    batch.push_back(frame);
+}
+
+void BufferManager::write_batch(vector<uint32_t>& batch){
+    // A page that a writer latched in the meantime is changed again, it is
+    // left dirty for the next round;
+    size_t latched = 0;
+    for(uint32_t frame : batch){
+        BufferFrame& page = frames[frame];
+        if(page.latch.try_lock_shared()) batch[latched++] = frame;
+        else{
+            page.dirty = true;
+            unfix_frame(page);
+            pending_io--;
+        }
+    }
+    batch.resize(latched);
+    // The log goes first, once for the whole batch;
+    if(log){
+        uint64_t lsn = 0;
+        for(uint32_t frame : batch) lsn = max(lsn, frames[frame].lsn.load());
+        try{
+            log->flush(lsn);
+        }
+        catch(const std::exception&){
+            for(uint32_t frame : batch){
+                frames[frame].dirty = true;
+                frames[frame].latch.unlock_shared();
+                unfix_frame(frames[frame]);
+                pending_io--;
             }
+            batch.clear();
+            return;
         }
-        if (list_ptr->next) {
-            list_ptr->next->prev = list_ptr->prev; // Update the previous pointer of the next node.
+    }
+    sort(batch.begin(), batch.end(), [this](uint32_t a, uint32_t b){
+        return frames[a].page_id < frames[b].page_id;
+    });
+    // Start the writes of all runs, then wait for them. Files without
+    // asynchronous I/O write in submit already;
+    vector<const char*> blocks;
+    vector<tuple<size_t, size_t, File::Ticket>> writes;    // run of pages in batch, ticket
+    auto start = chrono::steady_clock::now();
+    StatSlot& slot = local_stats();
+    for(size_t first = 0; first < batch.size(); ){
+        // Collect the run of consecutive pages of one segment;
+        BufferFrame& page = frames[batch[first]];
+        size_t last = first + 1;
+        while(last < batch.size() && frames[batch[last]].segment == page.segment &&
+              frames[batch[last]].segment_id == page.segment_id + (last - first)) last++;
+        blocks.clear();
+        for(size_t i = first; i < last; i++) blocks.push_back(frames[batch[i]].data);
+        try{
+            File& file = segment_file(page.segment);
+            writes.emplace_back(first, last, file.submit_write_blocks(blocks.data(), blocks.size(), page.segment_id * page_size, page_size));
         }
-        else {
-            // If there is no next node, list_ptr is the tail.
-            tail = list_ptr->prev;
+        catch(const std::exception&){
+            // Leave the pages to a miss, which reports the error to its caller;
+            for(size_t i = first; i < last; i++) frames[batch[i]].dirty = true;
         }
+        first = last;
     }
-    
-    // Remove the page_id from the vector
-    if(fifo){
-        delete_num_vec(fifo_vec, page_id);
+    for(auto& [first, last, ticket] : writes){
+        try{
+            segment_file(frames[batch[first]].segment).wait(ticket);
+            for(size_t i = first; i < last; i++) frames[batch[i]].rec_lsn = 0;
+            slot.write_backs.fetch_add(last - first, memory_order_relaxed);
+            record_latency(slot.write_latency, start);
+        }
+        catch(const std::exception&){
+            for(size_t i = first; i < last; i++) frames[batch[i]].dirty = true;
+        }
     }
-    else{
-        delete_num_vec(lru_vec, page_id);
+    // Direct writes are made durable once per file and batch, the pages of
+    // a segment are next to each other in the batch. With a log they are
+    // durable already;
+    for(size_t first = 0; direct_io && !log && first < batch.size(); ){
+        uint16_t segment = frames[batch[first]].segment;
+        size_t last = first + 1;
+        while(last < batch.size() && frames[batch[last]].segment == segment) last++;
+        try{
+            segment_file(segment).sync();
+        }
+        catch(const std::exception&){
+            for(size_t i = first; i < last; i++) frames[batch[i]].dirty = true;
+        }
+        first = last;
     }
-    list_ptr->page_ptr->fixed--;
-    page_num--;
-    hash_table.erase(page_id);  // Remove key from the hash table
-    return;
+    for(uint32_t frame : batch){
+        BufferFrame& page = frames[frame];
+        page.latch.unlock_shared();
+        unfix_frame(page);
+        pending_io--;
+    }
+    batch.clear();
 }
 
+// A miss of the page after the last miss of the segment continues a run,
+// a long enough run is a scan. The detectors are shared by the segments of
+// a slot and updated without a latch, a lost update only delays a read-ahead;
+void BufferManager::detect_scan(uint64_t page_id){
+    ScanDetector& scan = scans[get_segment_id(page_id) % kScanSlots];
+    uint32_t run = (scan.next_page.load(memory_order_relaxed) == page_id) ? scan.run.load(memory_order_relaxed) + 1 : 1;
+    scan.next_page.store(page_id + 1, memory_order_relaxed);
+    scan.run.store(run, memory_order_relaxed);
+    size_t window = min(read_ahead.load(memory_order_relaxed), page_count / 4);
+    // The trigger pages keep a read ahead going, a scan misses again only
+    // when it overtook the read ahead or a window was evicted unused;
+    if(run >= kSequentialRun && window > 0) request_prefetch(page_id + 1, window, true);
+}
 
-// Move page from fifo_queue to lru_queque;
-void BufferManager::move_page(shared_ptr<Linked_BufferFrame> list_ptr){
+bool BufferManager::request_prefetch(uint64_t first, size_t count, bool trigger){
     {
-    unique_lock<mutex> my_lock(fifo_mtx);
-    delete_page(fifo_head,list_ptr,true);
-    }
-    {
-    unique_lock<mutex> my_lock(lru_mtx);
-    insert_page(lru_head,list_ptr,false);
+    unique_lock<mutex> my_lock(prefetch_mtx);
+    if(prefetch_queue.size() >= kMaxPrefetchQueue) return false;
+    prefetch_queue.push_back(PrefetchRequest{first, count, trigger});
     }
+    prefetch_cv.notify_one();
+    return true;
 }
 
-void BufferManager::write_back_page(const shared_ptr<Linked_BufferFrame> ptr){
-    uint16_t segment_value = ptr->page_ptr->segment;
-    string segment_str = std::to_string(segment_value);
-    // Obtain a const char* from the string
-    const char* filename = segment_str.c_str();
-    std::unique_ptr<File> file = File::open_file(filename, File::WRITE);
-    size_t offset = ptr->page_ptr->segment_id * page_size;
-    file->write_block(ptr->page_ptr->data_array.get(),offset,page_size);// Write to the disk
-    return;
+void BufferManager::prefetch_loop(){
+    unique_lock<mutex> my_lock(prefetch_mtx);
+    while(true){
+        prefetch_cv.wait(my_lock, [this]{ return stop_prefetcher || !prefetch_queue.empty(); });
+        if(stop_prefetcher) break;
+        PrefetchRequest request = prefetch_queue.front();
+        prefetch_queue.pop_front();
+        my_lock.unlock();
+        read_ahead_pages(request);
+        my_lock.lock();
+    }
 }
 
-unique_ptr<char[]> BufferManager::read_disk_file(uint64_t page_id){
-    uint16_t segment = static_cast<uint16_t>(page_id >> 48);
-    std::string segment_str = std::to_string(segment);
-    // Obtain a const char* from the string
-    const char* filename = segment_str.c_str();
-    uint64_t segment_id = (page_id<<16)>>16;
-    size_t offset = segment_id * page_size;
-    unique_ptr<buzzdb::File> file = File::open_file(filename, File::WRITE);
-    unique_ptr<char []> file_data = file->read_block(offset,page_size);
-    return file_data;
-}
-
-// Select page from buffer to move out;
-pair<bool,bool> BufferManager::victim_page(){
-    // Find page in fifo
-    shared_ptr<Linked_BufferFrame> ptr = fifo_tail;
-    while(ptr){
-        if(ptr->page_ptr->fixed == 0){
-            // Find the victim
-            if(ptr->page_ptr->dirty){
-                // If dirty, need to write back to disk
-                write_back_page(ptr);
-            }
-            {
-            unique_lock<mutex> my_lock(fifo_mtx);
-            // Delete page from the queue
-            delete_page(fifo_head,ptr,true);
-            if(ptr->next)   ptr->next.reset();
-            if(ptr->prev)   ptr->prev.reset();
-            if(ptr)         ptr.reset();
-            }
-            return {true,true};
+// Like a miss of every page, but all reads are submitted before the first
+// one is waited for. The pages are published latched, a fix of one of them
+// waits until it is read;
+void BufferManager::read_ahead_pages(const PrefetchRequest& request){
+    vector<uint32_t> loads;
+    for(size_t i = 0; i < request.count; i++){
+        uint64_t page_id = request.first + i;
+        if(get_segment_id(page_id) != get_segment_id(request.first)) break;
+        PageTablePartition& partition = partition_of(page_id);
+        {
+        unique_lock<mutex> my_lock(partition.mtx);
+        if(partition.pages.count(page_id)) continue;
+        }
+        uint32_t frame;
+        try{
+            frame = reserve_frame(page_id);
         }
-        ptr = ptr->prev;
+        catch(const std::exception&){
+            break;      // A victim could not be written, a miss reports it
+        }
+        if(frame == kNoFrame) break;    // Buffer is full, nothing to read ahead
+        BufferFrame& page = frames[frame];
+        page.latch.lock();
+        unique_lock<mutex> my_lock(partition.mtx);
+        if(partition.pages.count(page_id)){
+            my_lock.unlock();
+            page.latch.unlock();
+            release_frame(frame);
+            pending_io--;
+            continue;
+        }
+        page.prefetch = (i == 0 && request.trigger) ? PREFETCH_TRIGGER : PREFETCHED;
+        partition.pages[page_id] = frame;
+        loads.push_back(frame);
     }
-    ptr = lru_tail;
-    while(ptr){
-        if(ptr->page_ptr->fixed == 0){
-            // Find the victim
-            if(ptr->page_ptr->dirty){
-                write_back_page(ptr);
-            }
-            {
-            unique_lock<mutex> my_lock(lru_mtx);
-            // Delete page from the queue
-            delete_page(lru_head,ptr,false);
-            ptr.reset();
-            }
-            return {true,false};
+    vector<pair<uint32_t, File::Ticket>> reads;
+    auto start = chrono::steady_clock::now();
+    StatSlot& slot = local_stats();
+    for(uint32_t frame : loads){
+        BufferFrame& page = frames[frame];
+        try{
+            File& file = segment_file(page.segment);
+            reads.emplace_back(frame, file.submit_read(page.segment_id * page_size, page_size, page.data));
+        }
+        catch(const std::exception&){
+            abandon_page(frame);
         }
-        ptr = ptr->prev;
     }
-    return {false,false};
+    for(auto& [frame, ticket] : reads){
+        BufferFrame& page = frames[frame];
+        try{
+            segment_file(page.segment).wait(ticket);
+            slot.prefetches.fetch_add(1, memory_order_relaxed);
+            record_latency(slot.read_latency, start);
+        }
+        catch(const std::exception&){
+            abandon_page(frame);
+            continue;
+        }
+        page.latch.unlock();
+        unfix_frame(page);
+        pending_io--;
+    }
 }
 
+void BufferManager::prefetch_pages(uint64_t first_page_id, size_t count){
+    if(count > 0) request_prefetch(first_page_id, count, false);
+}
 
-BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive){
+void BufferManager::set_read_ahead(size_t pages){
+    read_ahead = pages;
+}
+
+// Put a frame that was not published back into the free list;
+void BufferManager::release_frame(uint32_t frame){
+    unique_lock<mutex> my_lock(list_mtx);
+    policy->remove(frame);
+    frames[frame].fixed = 0;
+    frames[frame].next = free_head;
+    free_head = frame;
+    my_lock.unlock();
+    frame_released();
+}
+
+// The frame keeps its place in the policy and is evicted like any other page.
+// It is not freed, a fix that found the page before it was taken out may still
+// hold it and finds it gone once it gets the latch;
+void BufferManager::abandon_page(uint32_t frame){
+    BufferFrame& page = frames[frame];
+    {
+    PageTablePartition& partition = partition_of(page.page_id);
+    unique_lock<mutex> my_lock(partition.mtx);
+    auto it = partition.pages.find(page.page_id);
+    if(it != partition.pages.end() && it->second == frame) partition.pages.erase(it);
+    }
+    page.latch.unlock();
+    unfix_frame(page);
+    pending_io--;
+}
+
+// Unfix a page, the last unfix lets a fix that waits for a frame try again;
+void BufferManager::unfix_frame(BufferFrame& page){
+    if(page.fixed.fetch_sub(1) == 1) frame_released();
+}
+
+// The epoch changes under frame_mtx, a waiter that saw the old epoch before
+// it tried to fix its page can not miss the change;
+void BufferManager::frame_released(){
+    if(frame_waiters.load() == 0) return;
     {
-    unique_lock<mutex> my_lock(shared_mtx);
-    auto it = hash_table.find(page_id);
+    unique_lock<mutex> my_lock(frame_mtx);
+    unfix_epoch++;
+    }
+    frame_cv.notify_all();
+}
+
+// Fix a page. A miss takes a slot for the page first, then publishes the
+// page in the page table and reads it without any latch but the one of the
+// page, so misses and hits of other pages go on in parallel;
+BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive){
+    BufferFrame* page = fix(page_id, exclusive ? EXCLUSIVE : SHARE);
+    // No page can victim, throw buffer_full_error{};
+    if(!page) throw buffer_full_error{};
+    return *page;
+}
+
+// Try the fix again whenever a page was unfixed, until the deadline;
+BufferFrame* BufferManager::fix_page_wait(uint64_t page_id, bool exclusive, chrono::milliseconds timeout){
+    auto deadline = chrono::steady_clock::now() + timeout;
+    BufferFrame* page = nullptr;
+    // A fix that throws must not leave the waiter counted, or every last
+    // unfix would wake up the waiters from then on;
+    frame_waiters++;
+    Defer waiting([this]{ frame_waiters--; });
+    while(true){
+        uint64_t epoch = unfix_epoch.load();
+        page = fix(page_id, exclusive ? EXCLUSIVE : SHARE);
+        if(page) break;
+        unique_lock<mutex> my_lock(frame_mtx);
+        if(!frame_cv.wait_until(my_lock, deadline, [&]{ return unfix_epoch.load() != epoch; })) break;
+    }
+    return page;
+}
+
+BufferFrame* BufferManager::fix(uint64_t page_id, LockType type){
+    PageTablePartition& partition = partition_of(page_id);
     //find the page in hash table, the page already in the buffer
-    if(it != hash_table.end()){
-        if(exclusive) {// Lock the page if exclusive;
-            it->second->page_ptr->mtx.lock();
-        }
-        shared_ptr<Linked_BufferFrame> current_ptr = it->second;
-        current_ptr->page_ptr->fixed++;
-        if(current_ptr->page_ptr->fifo){
-            // If the page in the fifo, move the page to lru and update the list_vector
-            {
-                move_page(current_ptr);  
-            } 
+    uint32_t frame = find_page(partition, page_id);
+    if(frame != kNoFrame){
+        BufferFrame* page = use_page(frame, page_id, type);
+        if(page){
+            local_stats().hits.fetch_add(1, memory_order_relaxed);
+            return page;
         }
-        else{
-            {
-            unique_lock<mutex> my_lock(lru_mtx);
-            // Move the page to the start of the linked list;
-            delete_page(lru_head,current_ptr,false);
-            insert_page(lru_head,current_ptr,false);
-            }
-        }
-        return *(current_ptr->page_ptr); // Return the reference of the page;
+        return fix(page_id, type);    // evicted while waiting, start over
     }
-    // Find page in the disk;
-    unique_ptr<char []> file_data = read_disk_file(page_id);
     // Need a new page;
-    shared_ptr<BufferFrame> page_ptr = make_shared<BufferFrame>(page_id, exclusive,move(file_data));
-    Linked_BufferFrame current_frame(page_ptr);
-    shared_ptr<Linked_BufferFrame> ptr = make_shared<Linked_BufferFrame>(current_frame);
-    if(exclusive) ptr->page_ptr->mtx.lock();// Lock the page if exclusive;
-    // Insert a new page
-    if(page_num < page_count){
-        // Just insert into fifo_queue
-        {
-        unique_lock<mutex> my_lock(fifo_mtx);
-        insert_page(fifo_head, ptr, true);// Insert into fifo_queue.
+    if(read_ahead.load(memory_order_relaxed) > 0) detect_scan(page_id);
+    frame = reserve_frame(page_id);
+    if(frame == kNoFrame){
+        // All pages are fixed;
+        local_stats().full.fetch_add(1, memory_order_relaxed);
+        return nullptr;
+    }
+    BufferFrame& page = frames[frame];
+    page.latch.lock();   // Hold the page until it is read
+    {
+    unique_lock<mutex> my_lock(partition.mtx);
+    auto it = partition.pages.find(page_id);
+    if(it != partition.pages.end()){
+        // Another thread read the page in the meantime, use that one;
+        uint32_t other = it->second;
+        frames[other].fixed++;
+        my_lock.unlock();
+        page.latch.unlock();
+        release_frame(frame);
+        pending_io--;
+        BufferFrame* other_page = use_page(other, page_id, type);
+        if(other_page){
+            local_stats().hits.fetch_add(1, memory_order_relaxed);
+            return other_page;
         }
-        // Lock the page if exclusive;
-        return *ptr->page_ptr;
+        return fix(page_id, type);
+    }
+    partition.pages[page_id] = frame;
+    }
+    // Find page in the disk;
+    try{
+        read_disk_file(page_id, page.data);
     }
-    // Victim a page
-    pair<bool,bool> victim = victim_page(); //(victim, fifo)
-    if(victim.first){
-        if(victim.second)
+    catch(const std::exception&){
+        abandon_page(frame);
+        throw;
+    }
+    pending_io--;
+    local_stats().misses.fetch_add(1, memory_order_relaxed);
+    if(type == EXCLUSIVE) page.owner = this_thread::get_id();
+    else if(type == SHARE) page.latch.downgrade();
+    else page.latch.unlock();
+    return &page;
+}   
+
+// The change is in the page already, the record takes its bytes from there;
+uint64_t BufferManager::log_page(BufferFrame& page, size_t offset, size_t size){
+    if(offset + size > page_size) throw std::invalid_argument("change does not fit in the page");
+    page.dirty = true;
+    if(!log) return 0;
+    // rec_lsn is set under the log mutex: a checkpoint that took its begin
+    // LSN after the record sees the page dirty and keeps the record;
+    uint64_t lsn = log->append(page.page_id, static_cast<uint32_t>(offset), page.data + offset, static_cast<uint32_t>(size),
+                               [&page, size](uint64_t record_lsn){
+        if(page.rec_lsn == 0) page.rec_lsn = record_lsn - sizeof(LogRecordHeader) - size;
+    });
+    page.lsn = lsn;
+    return lsn;
+}
+
+// Write the pages that were changed before the checkpoint began, kCleanBatch
+// frames at a time so that misses wait for list_mtx no longer than for the
+// cleaner. A page that is changed again meanwhile stays dirty for the next
+// checkpoint. The changes of the pages that are left hold the redo LSN back.
+// A page that was written is only durable once the segment files are
+// synced, so the redo LSN is taken before the sync;
+void BufferManager::checkpoint(){
+    if(!log) return;
+    unique_lock<mutex> my_lock(checkpoint_mtx);
+    uint64_t begin_lsn = log->get_end_lsn();
+    vector<uint32_t> batch;
+    batch.reserve(kCleanBatch);
+    for(size_t first = 0; first < page_count; first += kCleanBatch){
         {
-        unique_lock<mutex> my_lock(fifo_mtx);
-        insert_page(fifo_head, ptr, true);// Insert into fifo_queue.
+        unique_lock<mutex> list_lock(list_mtx);
+        size_t last = min(page_count, first + kCleanBatch);
+        for(size_t frame = first; frame < last; frame++){
+            uint64_t rec_lsn = frames[frame].rec_lsn.load();
+            if(rec_lsn != 0 && rec_lsn < begin_lsn) collect_page(static_cast<uint32_t>(frame), batch);
         }
-        else{
-        unique_lock<mutex> my_lock(lru_mtx);
-        insert_page(lru_head, ptr, false);// Insert into lru_queue.
         }
-        return *ptr->page_ptr;
+        write_batch(batch);
     }
+    uint64_t redo_lsn = begin_lsn;
+    for(size_t frame = 0; frame < page_count; frame++){
+        uint64_t rec_lsn = frames[frame].rec_lsn.load();
+        if(rec_lsn != 0) redo_lsn = min(redo_lsn, rec_lsn);
     }
-    // No page can victim, throw buffer_full_error{};
-    throw buffer_full_error{};
-}   
+    vector<File*> files;
+    {
+    unique_lock<mutex> file_lock(file_mtx);
+    for(auto& [segment, file] : segment_files) files.push_back(file.get());
+    }
+    for(File* file : files) file->sync();
+    log->checkpoint(redo_lsn);
+}
+
+void BufferManager::checkpoint_loop(){
+    unique_lock<mutex> my_lock(checkpointer_mtx);
+    while(!stop_checkpointer){
+        checkpointer_cv.wait_for(my_lock, kCheckpointInterval);
+        if(stop_checkpointer) break;
+        if(log->get_end_lsn() - log->get_redo_lsn() < kCheckpointLogSize) continue;
+        my_lock.unlock();
+        // A failed checkpoint leaves the last one in place, the next try
+        // writes the pages again;
+        try{
+            checkpoint();
+        }
+        catch(const std::exception&){}
+        my_lock.lock();
+    }
+}
+
+void BufferManager::commit(uint64_t lsn){
+    if(log) log->flush(lsn);
+}
+
+// Fix the page without latching it;
+BufferFrame& BufferManager::fix_page_optimistic(uint64_t page_id, uint64_t& version){
+    BufferFrame* page = fix(page_id, OPTIMISTIC);
+    if(!page) throw buffer_full_error{};
+    version = page->latch.optimistic_version();
+    return *page;
+}
+
+bool BufferManager::unfix_page_optimistic(BufferFrame& page, uint64_t version){
+    bool valid = page.latch.validate(version);
+    unfix_frame(page);
+    return valid;
+}
 
 
 void BufferManager::unfix_page(BufferFrame& page, bool is_dirty) {
-    page.fixed--;
     if(is_dirty) page.dirty = true; // Set dirty if is_dirty
-    if(page.type == EXCLUSIVE){
-        page.mtx.unlock();
+    // The thread that holds the latch exclusively can not hold it shared as well;
+    if(page.owner == this_thread::get_id()){
+        page.owner = thread::id();
+        page.latch.unlock();
     }
+    else page.latch.unlock_shared();
+    unfix_frame(page);  // Last, the page may be evicted from here on
     return;
 }
 
-
-std::vector<uint64_t> BufferManager::get_fifo_list() const {
-    return fifo_vec;
+// Sum up the slots, each counter is read on its own;
+BufferStats BufferManager::get_stats() const {
+    BufferStats total;
+    for(const StatSlot& slot : stats){
+        total.hits += slot.hits.load(memory_order_relaxed);
+        total.misses += slot.misses.load(memory_order_relaxed);
+        total.promotions += slot.promotions.load(memory_order_relaxed);
+        total.evictions += slot.evictions.load(memory_order_relaxed);
+        total.write_backs += slot.write_backs.load(memory_order_relaxed);
+        total.prefetches += slot.prefetches.load(memory_order_relaxed);
+        total.full += slot.full.load(memory_order_relaxed);
+        total.latch_waits += slot.latch_waits.load(memory_order_relaxed);
+        total.latch_wait_ns += slot.latch_wait_ns.load(memory_order_relaxed);
+        for(size_t i = 0; i < kLatencyBuckets; i++){
+            total.read_latency[i] += slot.read_latency[i].load(memory_order_relaxed);
+            total.write_latency[i] += slot.write_latency[i].load(memory_order_relaxed);
+        }
+    }
+    return total;
 }
 
+void BufferManager::set_stats_dump(ostream* out, chrono::milliseconds interval){
+    unique_lock<mutex> my_lock(cleaner_mtx);
+    stats_out = out;
+    stats_interval = interval;
+}
 
-std::vector<uint64_t> BufferManager::get_lru_list() const {
-    return lru_vec;
+double BufferStats::hit_ratio() const {
+    uint64_t fixes = hits + misses;
+    return fixes ? static_cast<double>(hits) / fixes : 0;
 }
 
+uint64_t BufferStats::latency_percentile(const uint64_t (&buckets)[kLatencyBuckets], double p){
+    uint64_t count = 0;
+    for(uint64_t n : buckets) count += n;
+    if(count == 0) return 0;
+    // The bucket that holds the I/O of rank ceil(p * count);
+    uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(p * count)));
+    uint64_t seen = 0;
+    for(size_t i = 0; i < kLatencyBuckets; i++){
+        seen += buckets[i];
+        if(seen >= rank) return uint64_t(1) << i;
+    }
+    return uint64_t(1) << (kLatencyBuckets - 1);
+}
 
-void BufferManager::delete_num_vec(vector<uint64_t>& vec, uint64_t num) {
-        auto it = std::find(vec.begin(), vec.end(), num);
+void BufferStats::print(ostream& out) const {
+    out << "hits " << hits << " misses " << misses << " hit ratio " << hit_ratio()
+        << " promotions " << promotions << " evictions " << evictions
+        << " write backs " << write_backs << " prefetches " << prefetches << " full " << full
+        << " latch waits " << latch_waits << " (" << latch_wait_ns / 1000 << " us)"
+        << " read p50/p99 < " << latency_percentile(read_latency, 0.5) << "/" << latency_percentile(read_latency, 0.99) << " us"
+        << " write p50/p99 < " << latency_percentile(write_latency, 0.5) << "/" << latency_percentile(write_latency, 0.99) << " us\n";
+}
 
-        if (it != vec.end()) {
-            vec.erase(it);
-        }
+// Collect the page ids of a list from the oldest page at the tail to the
+// newest one at the head;
+std::vector<uint64_t> BufferManager::collect_list(bool fifo) const {
+    std::vector<uint64_t> page_ids;
+    unique_lock<mutex> my_lock(list_mtx);
+    for(uint32_t frame : policy->queue(fifo)){
+        page_ids.push_back(frames[frame].page_id);
     }
+    return page_ids;
+}
+
+
+std::vector<uint64_t> BufferManager::get_fifo_list() const {
+    return collect_list(true);
+}
+
+
+std::vector<uint64_t> BufferManager::get_lru_list() const {
+    return collect_list(false);
+}
 
 }  // namespace buzzdb
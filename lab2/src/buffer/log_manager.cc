@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "buffer/log_manager.h"
+#include "storage/file.h"
+
+using namespace std;
+
+namespace buzzdb {
+
+namespace {
+
+// FNV-1a, a torn record fails the check;
+void add_to_hash(uint64_t& hash, const char* bytes, size_t size){
+    for(size_t i = 0; i < size; i++){
+        hash ^= static_cast<unsigned char>(bytes[i]);
+        hash *= 0x100000001b3ull;
+    }
+}
+
+uint64_t checksum(const LogRecordHeader& header, const char* data){
+    LogRecordHeader copy = header;
+    copy.checksum = 0;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    add_to_hash(hash, reinterpret_cast<const char*>(&copy), sizeof(copy));
+    add_to_hash(hash, data, header.size);
+    return hash;
+}
+
+uint64_t checksum(const LogHeader& header){
+    uint64_t hash = 0xcbf29ce484222325ull;
+    add_to_hash(hash, reinterpret_cast<const char*>(&header.magic), sizeof(header.magic));
+    add_to_hash(hash, reinterpret_cast<const char*>(&header.redo_lsn), sizeof(header.redo_lsn));
+    return hash;
+}
+
+}  // namespace
+
+// The log is synced as a whole by flush(), not by every write;
+LogManager::LogManager(const string& filename):
+file(File::open_file(filename.c_str(), File::WRITE, false, false)),
+buffer_lsn(kLogStart),
+end_lsn(kLogStart),
+flushing(false),
+flushed_lsn(kLogStart),
+redo_lsn(kLogStart){}
+
+LogManager::~LogManager(){
+    // Do not throw from the destructor, the records are lost then;
+    try{
+        flush(end_lsn);
+    }
+    catch(const std::exception&){}
+}
+
+// Start at the redo LSN of the header, a new log gets a header first. Read
+// the records one after the other until one does not check out;
+void LogManager::recover(const Redo& redo){
+    size_t file_size = file->size();
+    uint64_t lsn = kLogStart;
+    LogHeader log_header;
+    if(file_size >= kLogStart){
+        file->read_block(0, sizeof(log_header), reinterpret_cast<char*>(&log_header));
+        if(log_header.magic == kLogMagic && log_header.checksum == checksum(log_header) &&
+           log_header.redo_lsn >= kLogStart && log_header.redo_lsn <= file_size) lsn = log_header.redo_lsn;
+    }
+    else{
+        file->resize(kLogStart);
+        write_header(kLogStart);
+        file_size = kLogStart;
+    }
+    uint64_t start = lsn;
+    vector<char> data;
+    while(lsn + sizeof(LogRecordHeader) <= file_size){
+        LogRecordHeader header;
+        file->read_block(lsn, sizeof(header), reinterpret_cast<char*>(&header));
+        uint64_t end = lsn + sizeof(header) + header.size;
+        if(end > file_size || header.lsn != end) break;
+        data.resize(header.size);
+        file->read_block(lsn + sizeof(header), header.size, data.data());
+        if(header.checksum != checksum(header, data.data())) break;
+        // The record is durable, a page that redo writes back does not wait for it;
+        flushed_lsn = end;
+        redo(header.lsn, header.page_id, header.offset, data.data(), header.size);
+        lsn = end;
+    }
+    if(lsn < file_size){
+        file->resize(lsn);
+        file->sync();
+    }
+    unique_lock<mutex> my_lock(log_mtx);
+    buffer_lsn = end_lsn = lsn;
+    flushed_lsn = lsn;
+    redo_lsn = start;
+}
+
+uint64_t LogManager::get_end_lsn(){
+    unique_lock<mutex> my_lock(log_mtx);
+    return end_lsn;
+}
+
+void LogManager::write_header(uint64_t lsn){
+    LogHeader header;
+    header.magic = kLogMagic;
+    header.redo_lsn = lsn;
+    header.checksum = checksum(header);
+    file->write_block(reinterpret_cast<const char*>(&header), 0, sizeof(header));
+    file->sync();
+}
+
+// The records from lsn on have to be in the log before the header points to
+// them. The header is written in place, it fits in one sector;
+void LogManager::checkpoint(uint64_t lsn){
+    uint64_t old_lsn = redo_lsn.load();
+    if(lsn <= old_lsn) return;
+    flush(lsn);
+    write_header(lsn);
+    redo_lsn = lsn;
+    file->discard(old_lsn, lsn - old_lsn);
+}
+
+uint64_t LogManager::append(uint64_t page_id, uint32_t offset, const char* data, uint32_t size,
+                            const Appended& appended){
+    LogRecordHeader header;
+    header.page_id = page_id;
+    header.offset = offset;
+    header.size = size;
+    unique_lock<mutex> my_lock(log_mtx);
+    end_lsn += sizeof(header) + size;
+    header.lsn = end_lsn;
+    header.checksum = checksum(header, data);
+    buffer.insert(buffer.end(), reinterpret_cast<const char*>(&header), reinterpret_cast<const char*>(&header) + sizeof(header));
+    buffer.insert(buffer.end(), data, data + size);
+    if(appended) appended(end_lsn);
+    return end_lsn;
+}
+
+// Group commit. The first thread that finds no flush going on writes all
+// records appended so far, the threads that come meanwhile wait for it and
+// then the next one of them writes what was appended during that write;
+void LogManager::flush(uint64_t lsn){
+    if(flushed_lsn.load() >= lsn) return;
+    unique_lock<mutex> my_lock(log_mtx);
+    // Nothing goes beyond the end, a page keeps its LSN when the log is truncated;
+    lsn = min(lsn, end_lsn);
+    while(flushed_lsn.load() < lsn){
+        if(flushing){
+            flushed_cv.wait(my_lock);
+            continue;
+        }
+        flushing = true;
+        vector<char> group;
+        group.swap(buffer);
+        buffer.swap(spare);
+        uint64_t group_lsn = buffer_lsn;
+        uint64_t group_end = end_lsn;
+        buffer_lsn = end_lsn;
+        my_lock.unlock();
+        try{
+            file->resize(group_end);
+            file->write_block(group.data(), group_lsn, group.size());
+            file->sync();
+        }
+        catch(const std::exception&){
+            // Put the records back in front of the ones appended meanwhile;
+            my_lock.lock();
+            group.insert(group.end(), buffer.begin(), buffer.end());
+            buffer.swap(group);
+            buffer_lsn = group_lsn;
+            flushing = false;
+            flushed_cv.notify_all();
+            throw;
+        }
+        group.clear();
+        my_lock.lock();
+        spare.swap(group);
+        flushing = false;
+        flushed_lsn = group_end;
+        flushed_cv.notify_all();
+    }
+}
+
+void LogManager::truncate(){
+    unique_lock<mutex> my_lock(log_mtx);
+    flushed_cv.wait(my_lock, [this]{ return !flushing; });
+    buffer.clear();
+    file->resize(kLogStart);
+    write_header(kLogStart);
+    buffer_lsn = end_lsn = kLogStart;
+    flushed_lsn = kLogStart;
+    redo_lsn = kLogStart;
+}
+
+}  // namespace buzzdb
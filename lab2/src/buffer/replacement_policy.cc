@@ -0,0 +1,327 @@
+
+#include <algorithm>
+#include "buffer/replacement_policy.h"
+
+using namespace std;
+
+namespace buzzdb {
+
+unique_ptr<ReplacementPolicy> ReplacementPolicy::make(PolicyType type, size_t frame_count){
+    switch(type){
+        case CLOCK: return make_unique<ClockPolicy>(frame_count);
+        case LRU_K: return make_unique<LruKPolicy>(frame_count);
+        case ARC: return make_unique<ArcPolicy>(frame_count);
+        default: return make_unique<TwoQueuePolicy>(frame_count);
+    }
+}
+
+FrameLists::FrameLists(size_t frame_count):
+prev_frame(frame_count, kNoFrame),
+next_frame(frame_count, kNoFrame){}
+
+FrameLists::List FrameLists::make_list(){
+    return List{kNoFrame, kNoFrame, 0};
+}
+
+// Insert frame at the head of a list;
+void FrameLists::push_head(List& list, uint32_t frame){
+    prev_frame[frame] = kNoFrame;
+    next_frame[frame] = list.head;
+    if(list.head == kNoFrame) list.tail = frame;
+    else prev_frame[list.head] = frame;
+    list.head = frame;
+    list.size++;
+}
+
+// Delete frame from a list;
+void FrameLists::erase(List& list, uint32_t frame){
+    if(prev_frame[frame] == kNoFrame) list.head = next_frame[frame];
+    else next_frame[prev_frame[frame]] = next_frame[frame];
+    if(next_frame[frame] == kNoFrame) list.tail = prev_frame[frame];
+    else prev_frame[next_frame[frame]] = prev_frame[frame];
+    prev_frame[frame] = kNoFrame;
+    next_frame[frame] = kNoFrame;
+    list.size--;
+}
+
+// 2Q: a new page goes to the FIFO list, a page that is fixed again moves to
+// the LRU list. Victims are searched in the FIFO list first, so pages that
+// were used once, like the pages of a scan, leave first;
+TwoQueuePolicy::TwoQueuePolicy(size_t frame_count):
+links(frame_count),
+fifo_list(FrameLists::make_list()),
+lru_list(FrameLists::make_list()),
+in_fifo(frame_count, false){}
+
+void TwoQueuePolicy::insert(uint32_t frame, uint64_t page_id){
+    (void)page_id;
+    links.push_head(fifo_list, frame);
+    in_fifo[frame] = true;
+}
+
+bool TwoQueuePolicy::access(uint32_t frame){
+    if(in_fifo[frame]){
+        // If the page in the fifo, move the page to lru
+        links.erase(fifo_list, frame);
+        links.push_head(lru_list, frame);
+        in_fifo[frame] = false;
+        return true;
+    }
+    if(frame != lru_list.head){
+        // Move the page to the start of the linked list;
+        links.erase(lru_list, frame);
+        links.push_head(lru_list, frame);
+    }
+    return false;
+}
+
+void TwoQueuePolicy::remove(uint32_t frame){
+    links.erase(in_fifo[frame] ? fifo_list : lru_list, frame);
+}
+
+uint32_t TwoQueuePolicy::victim(const function<Candidate(uint32_t)>& check){
+    for(FrameLists::List* list : {&fifo_list, &lru_list}){
+        for(uint32_t frame = list->tail; frame != kNoFrame; frame = links.prev(frame)){
+            Candidate candidate = check(frame);
+            if(candidate == STOP) return kNoFrame;
+            if(candidate == TAKE){
+                links.erase(*list, frame);
+                return frame;
+            }
+        }
+    }
+    return kNoFrame;
+}
+
+void TwoQueuePolicy::candidates(size_t count, vector<uint32_t>& frames) const{
+    for(const FrameLists::List* list : {&fifo_list, &lru_list}){
+        uint32_t frame = list->tail;
+        for(size_t i = 0; i < count && frame != kNoFrame; i++, frame = links.prev(frame)){
+            frames.push_back(frame);
+        }
+    }
+}
+
+vector<uint32_t> TwoQueuePolicy::queue(bool fifo) const{
+    vector<uint32_t> frames;
+    for(uint32_t frame = fifo ? fifo_list.tail : lru_list.tail; frame != kNoFrame; frame = links.prev(frame)){
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+// CLOCK: the hand sweeps over the frames and evicts the first unfixed page
+// whose reference bit is clear, clearing the bits it passes. A new page
+// starts with a clear bit, it has to be fixed again to survive a sweep;
+ClockPolicy::ClockPolicy(size_t frame_count):
+frame_count(frame_count),
+hand(0),
+resident(frame_count, false),
+referenced(make_unique<atomic<bool>[]>(frame_count)){
+    for(size_t i = 0; i < frame_count; i++) referenced[i] = false;
+}
+
+void ClockPolicy::insert(uint32_t frame, uint64_t page_id){
+    (void)page_id;
+    resident[frame] = true;
+    referenced[frame].store(false, memory_order_relaxed);
+}
+
+bool ClockPolicy::access(uint32_t frame){
+    // Only written when it changes, hot pages do not bounce the cache line;
+    if(!referenced[frame].load(memory_order_relaxed)) referenced[frame].store(true, memory_order_relaxed);
+    return false;
+}
+
+void ClockPolicy::remove(uint32_t frame){
+    resident[frame] = false;
+}
+
+uint32_t ClockPolicy::victim(const function<Candidate(uint32_t)>& check){
+    // Two rounds clear every bit, a third one would only find fixed pages;
+    for(size_t step = 0; step < 2 * frame_count; step++){
+        uint32_t frame = static_cast<uint32_t>(hand);
+        hand = (hand + 1) % frame_count;
+        if(!resident[frame]) continue;
+        if(referenced[frame].load(memory_order_relaxed)){
+            referenced[frame].store(false, memory_order_relaxed);
+            continue;
+        }
+        Candidate candidate = check(frame);
+        if(candidate == STOP) return kNoFrame;
+        if(candidate == TAKE){
+            resident[frame] = false;
+            return frame;
+        }
+    }
+    return kNoFrame;
+}
+
+void ClockPolicy::candidates(size_t count, vector<uint32_t>& frames) const{
+    for(size_t step = 0; step < frame_count && count > 0; step++){
+        uint32_t frame = static_cast<uint32_t>((hand + step) % frame_count);
+        if(resident[frame]){
+            frames.push_back(frame);
+            count--;
+        }
+    }
+}
+
+// LRU-K: the backward K-distance of a page is the time since its K-th last
+// access. The page with the largest one is evicted, pages with less than K
+// accesses first. The history of a page is dropped when it is evicted;
+LruKPolicy::LruKPolicy(size_t frame_count):
+clock(0),
+history(frame_count){}
+
+LruKPolicy::Key LruKPolicy::key_of(uint32_t frame) const{
+    return Key{history[frame][K - 1], history[frame][0], frame};
+}
+
+void LruKPolicy::insert(uint32_t frame, uint64_t page_id){
+    (void)page_id;
+    history[frame].fill(0);
+    history[frame][0] = ++clock;
+    order.insert(key_of(frame));
+}
+
+bool LruKPolicy::access(uint32_t frame){
+    // The K-th access gives the page a K-th last access;
+    bool promoted = history[frame][K - 1] == 0;
+    order.erase(key_of(frame));
+    for(size_t i = K - 1; i > 0; i--) history[frame][i] = history[frame][i - 1];
+    history[frame][0] = ++clock;
+    order.insert(key_of(frame));
+    return promoted && history[frame][K - 1] != 0;
+}
+
+void LruKPolicy::remove(uint32_t frame){
+    order.erase(key_of(frame));
+}
+
+uint32_t LruKPolicy::victim(const function<Candidate(uint32_t)>& check){
+    for(auto it = order.begin(); it != order.end(); ++it){
+        uint32_t frame = get<2>(*it);
+        Candidate candidate = check(frame);
+        if(candidate == STOP) return kNoFrame;
+        if(candidate == TAKE){
+            order.erase(it);
+            return frame;
+        }
+    }
+    return kNoFrame;
+}
+
+void LruKPolicy::candidates(size_t count, vector<uint32_t>& frames) const{
+    for(auto it = order.begin(); it != order.end() && count > 0; ++it, count--){
+        frames.push_back(get<2>(*it));
+    }
+}
+
+// ARC (Megiddo and Modha): t1 holds pages seen once, t2 pages seen again,
+// b1 and b2 remember the pages evicted from them. A miss that hits b1 means
+// t1 was too small and grows its target, a hit in b2 shrinks it. Here the
+// victim is chosen before the missing page is known, so the target adapts
+// when the page is inserted, one eviction later than in the paper;
+bool ArcPolicy::Ghosts::erase(uint64_t page_id){
+    auto it = index.find(page_id);
+    if(it == index.end()) return false;
+    pages.erase(it->second);
+    index.erase(it);
+    return true;
+}
+
+void ArcPolicy::Ghosts::push_head(uint64_t page_id){
+    erase(page_id);
+    pages.push_front(page_id);
+    index[page_id] = pages.begin();
+}
+
+void ArcPolicy::Ghosts::pop_tail(){
+    index.erase(pages.back());
+    pages.pop_back();
+}
+
+ArcPolicy::ArcPolicy(size_t frame_count):
+capacity(frame_count),
+target(0),
+links(frame_count),
+t1(FrameLists::make_list()),
+t2(FrameLists::make_list()),
+in_list(frame_count, 0),
+page_of(frame_count, 0){}
+
+void ArcPolicy::insert(uint32_t frame, uint64_t page_id){
+    page_of[frame] = page_id;
+    size_t b1_size = b1.index.size();
+    size_t b2_size = b2.index.size();
+    if(b1.erase(page_id)){
+        target = min(capacity, target + max<size_t>(1, b2_size / b1_size));
+        links.push_head(t2, frame);
+        in_list[frame] = 2;
+    }
+    else if(b2.erase(page_id)){
+        size_t delta = max<size_t>(1, b1_size / b2_size);
+        target = (target > delta) ? target - delta : 0;
+        links.push_head(t2, frame);
+        in_list[frame] = 2;
+    }
+    else{
+        links.push_head(t1, frame);
+        in_list[frame] = 1;
+    }
+    // t1 and b1 hold at most c pages, all four lists at most 2c;
+    while(!b1.pages.empty() && t1.size + b1.pages.size() > capacity) b1.pop_tail();
+    while(!b2.pages.empty() && t1.size + t2.size + b1.pages.size() + b2.pages.size() > 2 * capacity) b2.pop_tail();
+}
+
+bool ArcPolicy::access(uint32_t frame){
+    bool promoted = in_list[frame] == 1;
+    links.erase(promoted ? t1 : t2, frame);
+    links.push_head(t2, frame);
+    in_list[frame] = 2;
+    return promoted;
+}
+
+void ArcPolicy::remove(uint32_t frame){
+    links.erase(in_list[frame] == 1 ? t1 : t2, frame);
+    in_list[frame] = 0;
+}
+
+uint32_t ArcPolicy::victim_from(FrameLists::List& list, bool recent, const function<Candidate(uint32_t)>& check, bool& stop){
+    for(uint32_t frame = list.tail; frame != kNoFrame; frame = links.prev(frame)){
+        Candidate candidate = check(frame);
+        if(candidate == STOP){
+            stop = true;
+            return kNoFrame;
+        }
+        if(candidate == TAKE){
+            links.erase(list, frame);
+            in_list[frame] = 0;
+            (recent ? b1 : b2).push_head(page_of[frame]);
+            return frame;
+        }
+    }
+    return kNoFrame;
+}
+
+uint32_t ArcPolicy::victim(const function<Candidate(uint32_t)>& check){
+    // Evict from t1 while it is larger than its target, fall back to the
+    // other list when all pages of one are fixed;
+    bool from_t1 = t1.size > 0 && t1.size > target;
+    bool stop = false;
+    uint32_t frame = victim_from(from_t1 ? t1 : t2, from_t1, check, stop);
+    if(frame == kNoFrame && !stop) frame = victim_from(from_t1 ? t2 : t1, !from_t1, check, stop);
+    return frame;
+}
+
+void ArcPolicy::candidates(size_t count, vector<uint32_t>& frames) const{
+    for(const FrameLists::List* list : {&t1, &t2}){
+        uint32_t frame = list->tail;
+        for(size_t i = 0; i < count && frame != kNoFrame; i++, frame = links.prev(frame)){
+            frames.push_back(frame);
+        }
+    }
+}
+
+}  // namespace buzzdb
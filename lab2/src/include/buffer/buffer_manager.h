@@ -1,21 +1,88 @@
 #pragma once
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <climits>
+#include <chrono>
+#include <condition_variable>
 #include <exception>
 #include <vector>
 #include <mutex>
+#include <thread>
 #include <queue>
+#include <deque>
 #include "common/macros.h"
+#include "storage/file.h"
+#include "buffer/replacement_policy.h"
+#include "buffer/log_manager.h"
 #include <unordered_map>
 #include <memory>
+#include <ostream>
+#include <string>
 using namespace std;
 namespace buzzdb {
 
 enum LockType {
     SHARE,
     EXCLUSIVE,
-    ORIGIN
+    ORIGIN,
+    OPTIMISTIC
+};
+
+// Latch of a buffer frame that can be held shared or exclusively, or read
+// optimistically. The version is odd while the latch is held exclusively and
+// changes with every exclusive section, so an optimistic reader can check
+// that the page did not change while it read it without writing the latch.
+// Waiting writers do not block new readers, a thread may take the shared
+// latch of a page it already holds shared.
+class PageLatch {
+public:
+    bool try_lock() {
+        uint64_t v = version.load();
+        if((v & 1) || !version.compare_exchange_strong(v, v + 1)) return false;
+        if(readers.load() == 0) return true;
+        version.store(v);   // Nothing was written, optimistic readers stay valid
+        return false;
+    }
+    void lock() {
+        while(!try_lock()) this_thread::yield();
+    }
+    void unlock() {
+        version.fetch_add(1, memory_order_release);
+    }
+    // Turn the exclusive latch into a shared one without letting a writer in.
+    void downgrade() {
+        readers.fetch_add(1);
+        version.fetch_add(1, memory_order_release);
+    }
+    bool try_lock_shared() {
+        readers.fetch_add(1);
+        if(!(version.load() & 1)) return true;
+        readers.fetch_sub(1);
+        return false;
+    }
+    void lock_shared() {
+        while(!try_lock_shared()) this_thread::yield();
+    }
+    void unlock_shared() {
+        readers.fetch_sub(1, memory_order_release);
+    }
+    // Wait until no writer holds the latch and return the version to validate.
+    uint64_t optimistic_version() const {
+        uint64_t v;
+        while((v = version.load(memory_order_acquire)) & 1) this_thread::yield();
+        return v;
+    }
+    // True if no writer held the latch since optimistic_version returned v.
+    bool validate(uint64_t v) const {
+        atomic_thread_fence(memory_order_acquire);
+        return version.load(memory_order_relaxed) == v;
+    }
+
+private:
+    atomic<uint64_t> version{0};
+    atomic<uint32_t> readers{0};
 };
 
 class BufferFrame {
@@ -25,15 +92,18 @@ private:
     uint64_t page_id;
     uint16_t segment;
     uint64_t segment_id;
-    unique_ptr<char[]> data_array;
-    LockType type;  
-    bool dirty;
-    int fixed;
-    bool fifo;
-    mutex mtx;
+    char* data;             // page_size bytes in the frame pool
+    atomic<bool> dirty;
+    atomic<int> fixed;      // changed under the latch of the page table partition, except by unfix_page
+    uint32_t next;          // next frame in the free list, changed under list_mtx
+    PageLatch latch;        // held exclusively while the page is read from disk
+    atomic<thread::id> owner;   // the thread that holds latch exclusively
+    atomic<uint8_t> prefetch;   // PrefetchState of a page that was read ahead and not used yet
+    atomic<uint64_t> lsn;       // LSN of the last logged change, the log is flushed up to it before the page is written
+    atomic<uint64_t> rec_lsn;   // start of the record of the first logged change that is not written back, 0 if none
 public:
+    BufferFrame();
     /// Returns a pointer to this page's data.
-    BufferFrame(uint64_t page_id, bool exclusive, unique_ptr<char[]>&& data_array );
     char* get_data();
 };
 
@@ -45,55 +115,270 @@ public:
     }
 };
 
-class Linked_BufferFrame{
-    public:
-        Linked_BufferFrame(shared_ptr<BufferFrame>& page_ptr);
-        shared_ptr<BufferFrame> page_ptr;   // current page;
-        shared_ptr<Linked_BufferFrame> next;  // point to the next page;
-        shared_ptr<Linked_BufferFrame> prev;  // point to the prev page;
+// The frame pool is aligned to huge pages, so the kernel can back it with them.
+static constexpr size_t kHugePage = 2 << 20;
+
+// With direct I/O pages are read into and written from the pool without the
+// page cache of the kernel, the page size must be a multiple of this.
+static constexpr size_t kDirectAlignment = 4096;
+
+// A page that was read ahead stays in the FIFO list on its first fix, it
+// was not accessed before. Fixing the trigger page of a read-ahead window
+// reads the next window.
+enum PrefetchState : uint8_t {
+    NOT_PREFETCHED,
+    PREFETCHED,
+    PREFETCH_TRIGGER
+};
+
+// Misses of this many consecutive pages of a segment start the read-ahead.
+static constexpr uint32_t kSequentialRun = 4;
+// Scans are detected per slot, the segment of a page picks the slot.
+static constexpr size_t kScanSlots = 16;
+// Read-ahead requests that are not handled yet beyond this are dropped.
+static constexpr size_t kMaxPrefetchQueue = 64;
+
+// The last miss of the scan detector of some segments.
+struct alignas(64) ScanDetector {
+    atomic<uint64_t> next_page{0};
+    atomic<uint32_t> run{0};
+};
+
+// Pages to be read by the prefetcher thread.
+struct PrefetchRequest {
+    uint64_t first;
+    size_t count;
+    bool trigger;   // The first page triggers the next window
+};
+
+// The page table is split into 2^kPartitionBits partitions with a latch
+// each, so fixes of different pages do not wait for each other.
+static constexpr size_t kPartitionBits = 4;
+static constexpr size_t kPartitions = size_t(1) << kPartitionBits;
+
+// A miss that finds all pages fixed lets the other threads run this often
+// before it reports the buffer as full, a page may be unfixed meanwhile.
+static constexpr size_t kFullRetries = 4;
+
+// The cleaner writes back up to kCleanBatch dirty pages from the tail of
+// each list per round. It runs when a miss found a dirty victim, and every
+// kCleanInterval otherwise.
+static constexpr size_t kCleanBatch = 64;
+static constexpr chrono::milliseconds kCleanInterval{10};
+
+// I/O latencies are counted in buckets, bucket i holds the reads or writes
+// that took less than 2^i microseconds, the last one all longer ones.
+static constexpr size_t kLatencyBuckets = 24;
+// Threads count into one of kStatSlots slots of counters, so the counters of
+// a hit are not shared between cores unless there are more threads.
+static constexpr size_t kStatSlots = 64;
+
+// What a buffer manager did since it was constructed.
+struct BufferStats {
+    uint64_t hits = 0;          // fixes of buffered pages
+    uint64_t misses = 0;        // fixes that read their page
+    uint64_t promotions = 0;    // pages the policy moved to its frequent pages, FIFO to LRU for 2Q
+    uint64_t evictions = 0;
+    uint64_t write_backs = 0;   // dirty pages written by misses, the cleaner and the destructor
+    uint64_t prefetches = 0;    // pages read ahead
+    uint64_t full = 0;          // fixes that found all pages fixed
+    uint64_t latch_waits = 0;   // fixes that waited for the latch of their page
+    uint64_t latch_wait_ns = 0;
+    uint64_t read_latency[kLatencyBuckets] = {};
+    uint64_t write_latency[kLatencyBuckets] = {};
+
+    // Fraction of the fixes that were hits, 0 if there were none.
+    double hit_ratio() const;
+    // Upper bound in microseconds of the latency of the fraction p of the
+    // I/Os of buckets, 0 if there were none.
+    static uint64_t latency_percentile(const uint64_t (&buckets)[kLatencyBuckets], double p);
+    // One line of the counters and latency percentiles.
+    void print(ostream& out) const;
+};
+
+// The counters of the threads of one slot, on its own cache line.
+struct alignas(64) StatSlot {
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+    atomic<uint64_t> promotions{0};
+    atomic<uint64_t> evictions{0};
+    atomic<uint64_t> write_backs{0};
+    atomic<uint64_t> prefetches{0};
+    atomic<uint64_t> full{0};
+    atomic<uint64_t> latch_waits{0};
+    atomic<uint64_t> latch_wait_ns{0};
+    atomic<uint64_t> read_latency[kLatencyBuckets] = {};
+    atomic<uint64_t> write_latency[kLatencyBuckets] = {};
+};
+
+// With a log, the checkpointer looks at the log every kCheckpointInterval
+// and takes a checkpoint once kCheckpointLogSize bytes were logged since the
+// redo LSN of the last one, so recovery reads about that much log.
+static constexpr chrono::milliseconds kCheckpointInterval{100};
+static constexpr uint64_t kCheckpointLogSize = 16 << 20;
+
+// One partition of the page table, on its own cache line.
+struct alignas(64) PageTablePartition {
+    mutex mtx;
+    unordered_map<uint64_t, uint32_t> pages;    // page id to frame
 };
 
 class BufferManager {
 private:
     // TODO: add your implementation here
-    unordered_map<uint64_t, shared_ptr<Linked_BufferFrame>> hash_table;
-    mutex fifo_mtx;
-    mutex lru_mtx;
-    mutex shared_mtx;
-    shared_ptr<Linked_BufferFrame> fifo_head;
-    shared_ptr<Linked_BufferFrame> fifo_tail;
-    shared_ptr<Linked_BufferFrame> lru_head;
-    shared_ptr<Linked_BufferFrame> lru_tail;
+    PageTablePartition partitions[kPartitions];
+    // Protects the replacement policy and the free list. It may be held
+    // while a partition latch is taken, never the other way round. No I/O is
+    // done while any of the latches is held.
+    mutable mutex list_mtx;
+    unique_ptr<ReplacementPolicy> policy;
+    uint32_t free_head;     // frames without a page
     size_t page_count;
     size_t page_size;
-    size_t page_num;  //current number of pages;
-    vector<uint64_t> fifo_vec;
-    vector<uint64_t> lru_vec;
+    // All page data lives in one region of page_count * page_size bytes that
+    // is mapped up front, frame i owns the i-th page_size bytes of it.
+    void* region;
+    size_t region_size;
+    char* pool;             // start of the page data in region
+    unique_ptr<BufferFrame[]> frames;
+    // The file of every segment that was used, opened on its first I/O and
+    // kept open until the manager is destroyed. With async_io the files use
+    // io_uring and the pool is registered with them. With direct_io they
+    // bypass the page cache, and the cleaner syncs them after every batch.
+    bool async_io;
+    bool direct_io;
+    // The write-ahead log, nullptr without a log file. With a log the
+    // segment files do not write through, the log makes changes durable.
+    unique_ptr<LogManager> log;
+    // One checkpoint at a time, by the checkpointer thread or checkpoint().
+    mutex checkpoint_mtx;
+    mutex file_mtx;
+    unordered_map<uint16_t, unique_ptr<File>> segment_files;
+    // Page reads and write backs in progress. The frames they fix are about
+    // to be released or handed to their caller, a miss that finds no victim
+    // waits for them before it gives up.
+    atomic<size_t> pending_io;
+    // Fixes that wait for a frame sleep on frame_cv until the epoch changes,
+    // which the last unfix of a page does while there are waiters.
+    mutex frame_mtx;
+    condition_variable frame_cv;
+    atomic<size_t> frame_waiters;
+    atomic<uint64_t> unfix_epoch;
+    // The cleaner thread writes dirty pages before they reach the tail of the
+    // lists, so a miss rarely has to write its victim back itself.
+    mutex cleaner_mtx;
+    condition_variable cleaner_cv;
+    bool stop_cleaner;
+    // Sequential misses start the read-ahead of read_ahead pages, 0 turns it
+    // off. The prefetcher thread reads the requested pages in the background.
+    atomic<size_t> read_ahead;
+    ScanDetector scans[kScanSlots];
+    mutex prefetch_mtx;
+    condition_variable prefetch_cv;
+    deque<PrefetchRequest> prefetch_queue;
+    bool stop_prefetcher;
+    // Counters of the threads, summed up by get_stats(). The cleaner prints
+    // them to stats_out every stats_interval, both guarded by cleaner_mtx.
+    StatSlot stats[kStatSlots];
+    ostream* stats_out;
+    chrono::milliseconds stats_interval;
+    mutex checkpointer_mtx;
+    condition_variable checkpointer_cv;
+    bool stop_checkpointer;
+    // The threads are last, they are started when everything else is set up.
+    // The checkpointer only runs with a log.
+    thread cleaner;
+    thread prefetcher;
+    thread checkpointer;
+
+    // Write page to disk
+    void write_back_page(BufferFrame& frame);
+    // Read page from disk into data
+    void read_disk_file(uint64_t page_id, char* data);
+    // The open file of a segment.
+    File& segment_file(uint16_t segment);
+
+    // The partition of the page table that holds page_id.
+    PageTablePartition& partition_of(uint64_t page_id);
+    // Find a page in the page table and fix it, kNoFrame if it is not buffered.
+    uint32_t find_page(PageTablePartition& partition, uint64_t page_id);
+    // Record the access to a fixed page in the policy and latch the page.
+    // nullptr if the page was evicted while its latch was awaited.
+    BufferFrame* use_page(uint32_t frame, uint64_t page_id, LockType type);
+    // Fix a page and latch it as type says, OPTIMISTIC does not latch.
+    // nullptr if the buffer is full.
+    BufferFrame* fix(uint64_t page_id, LockType type);
+    // Take a free frame, evicting an unfixed page if there is none, and hand
+    // it fixed to the policy. kNoFrame if all pages are fixed.
+    uint32_t reserve_frame(uint64_t page_id);
+    // Give back a frame that never made it into the page table.
+    void release_frame(uint32_t frame);
+    // Take a latched page whose read failed out of the page table, unlatch
+    // and unfix it. A fix of the page reads it again and gets the error.
+    void abandon_page(uint32_t frame);
+    // Unfix a page, waking the fixes that wait for a frame if it is unfixed.
+    void unfix_frame(BufferFrame& page);
+    // Wake the fixes that wait for a frame.
+    void frame_released();
+    // Evict the unfixed page the policy offers first under list_mtx. A dirty
+    // page is fixed and returned in dirty_frame instead, to be written back
+    // without latches.
+    uint32_t victim_page(uint32_t& dirty_frame);
+    // Loop of the cleaner thread.
+    void clean_pages();
+    // Fix and collect the unfixed dirty pages among the kCleanBatch pages of
+    // every queue of the policy that are evicted next, under list_mtx. They
+    // are clean from here on.
+    void collect_dirty(vector<uint32_t>& batch);
+    // Fix and collect the page of frame for write_batch if it is unfixed and
+    // dirty, under list_mtx.
+    void collect_page(uint32_t frame, vector<uint32_t>& batch);
+    // Loop of the checkpointer thread.
+    void checkpoint_loop();
+    // Write the collected pages back, consecutive pages of a segment with one
+    // write, and unfix them.
+    void write_batch(vector<uint32_t>& batch);
+    // Record a miss in the scan detector and read ahead of a sequential scan.
+    void detect_scan(uint64_t page_id);
+    // Queue pages for the prefetcher, false if the queue is full.
+    bool request_prefetch(uint64_t first, size_t count, bool trigger);
+    // Loop of the prefetcher thread.
+    void prefetch_loop();
+    // Read the pages of a request that are not buffered yet into free or
+    // evicted frames, stops when the buffer is full.
+    void read_ahead_pages(const PrefetchRequest& request);
+    // The counters of the calling thread.
+    StatSlot& local_stats();
+    // Count an I/O that started at start in buckets.
+    static void record_latency(atomic<uint64_t> (&buckets)[kLatencyBuckets], chrono::steady_clock::time_point start);
+    // Page ids of the FIFO or LRU list of 2Q, oldest first.
+    std::vector<uint64_t> collect_list(bool fifo) const;
+
 public:
     /// Constructor.
     /// @param[in] page_size  Size in bytes that all pages will have.
     /// @param[in] page_count Maximum number of pages that should reside in
     //                        memory at the same time.
-    BufferManager(size_t page_size, size_t page_count);
+    /// @param[in] async_io   Do the I/O of the segment files through io_uring,
+    ///                       the cleaner then keeps all its writes in flight
+    ///                       at the same time.
+    /// @param[in] direct_io  Bypass the page cache of the kernel, so pages are
+    ///                       only cached here. `page_size` must be a multiple
+    ///                       of `kDirectAlignment`, otherwise throws
+    ///                       `std::invalid_argument`. Writes are made durable
+    ///                       in batches by the cleaner and the destructor.
+    /// @param[in] policy     The replacement policy, see `PolicyType`.
+    /// @param[in] log_file   Keep a write-ahead log of the changes that are
+    ///                       passed to `log_page()` in this file. The
+    ///                       changes since the last checkpoint are redone
+    ///                       first, a clean shutdown empties it. Empty for
+    ///                       no log.
+    BufferManager(size_t page_size, size_t page_count, bool async_io = false, bool direct_io = false,
+                  PolicyType policy = TWO_QUEUE, const std::string& log_file = "");
 
     /// Destructor. Writes all dirty pages to disk.
     ~BufferManager();
 
-    // Insert Linked_BufferFrame into double linked list.
-    void insert_page(shared_ptr<Linked_BufferFrame>& head, shared_ptr<Linked_BufferFrame> list_ptr, bool fifo);
-    
-    // Delete Linked_BufferFrame from double linked list.
-    void delete_page(shared_ptr<Linked_BufferFrame>& head, shared_ptr<Linked_BufferFrame> list_ptr, bool fifo);
-    
-    // Move page from Fifo list to Lru list.
-    void move_page(shared_ptr<Linked_BufferFrame> list_ptr);
-    // Write page to disk
-    void write_back_page(const shared_ptr<Linked_BufferFrame> ptr);
-
-    unique_ptr<char[]> read_disk_file(uint64_t page_id);
-    pair<bool,bool> victim_page();
-
-    void delete_num_vec(vector<uint64_t>& vec, uint64_t num);
     /// Returns a reference to a `BufferFrame` object for a given page id. When
     /// the page is not loaded into memory, it is read from disk. Otherwise the
     /// loaded page is used.
@@ -107,19 +392,84 @@ public:
     ///                      non-exclusively (shared).
     BufferFrame& fix_page(uint64_t page_id, bool exclusive);
 
+    /// Like `fix_page()`, but when the buffer is full it waits until a page
+    /// is unfixed and tries again instead of throwing `buffer_full_error`.
+    /// Returns nullptr if the buffer is still full after `timeout`.
+    /// Is thread-safe.
+    BufferFrame* fix_page_wait(uint64_t page_id, bool exclusive, chrono::milliseconds timeout);
+
+    /// Returns the number of `fix_page_wait()` calls that are running.
+    size_t get_frame_waiters() const { return frame_waiters.load(); }
+
     /// Takes a `BufferFrame` reference that was returned by an earlier call to
     /// `fix_page()` and unfixes it. When `is_dirty` is / true, the page is
     /// written back to disk eventually.
     void unfix_page(BufferFrame& page, bool is_dirty);
 
+    /// Logs the change of `size` bytes at `offset` of a page that is fixed
+    /// exclusively, after they were changed. The page is marked dirty and is
+    /// not written before the log is durable up to the returned LSN. Returns
+    /// 0 without a log.
+    /// Is thread-safe.
+    uint64_t log_page(BufferFrame& page, size_t offset, size_t size);
+
+    /// Returns when all changes up to `lsn` are durable. The log is synced
+    /// once for the commits of all threads that wait at the same time.
+    /// Is thread-safe.
+    void commit(uint64_t lsn);
+
+    /// Takes a fuzzy checkpoint: the pages with logged changes from before
+    /// the checkpoint are written back a few at a time while other threads
+    /// go on fixing pages, then the log records that recovery does not need
+    /// any more are dropped. Does nothing without a log. The checkpointer
+    /// thread calls it as the log grows.
+    /// Is thread-safe.
+    void checkpoint();
+
+    /// Fixes a page for an optimistic read. The page is not latched, so
+    /// readers do not write to the latch of a hot page; a writer may change
+    /// the page while it is read. `version` is the version to validate.
+    BufferFrame& fix_page_optimistic(uint64_t page_id, uint64_t& version);
+
+    /// Unfixes a page fixed by `fix_page_optimistic()`. Returns false if the
+    /// page was latched exclusively since it was fixed, the data that was read
+    /// may be inconsistent then and the read has to be repeated.
+    bool unfix_page_optimistic(BufferFrame& page, uint64_t version);
+
+    /// Reads the pages `first_page_id` to `first_page_id + count - 1` of one
+    /// segment into the buffer in the background, so that later fixes of them
+    /// do not wait for the disk. Pages that are buffered already are skipped,
+    /// and no more pages are read when the buffer is full. A prefetched page
+    /// counts as accessed when it is fixed the first time.
+    /// Is thread-safe.
+    void prefetch_pages(uint64_t first_page_id, size_t count);
+
+    /// Sets how many pages are read ahead when misses of consecutive pages of
+    /// a segment show a sequential scan; 0 (the default) turns it off. At
+    /// most a quarter of the buffer is read ahead at once.
+    void set_read_ahead(size_t pages);
+
+    /// Returns the counters of all threads summed up. They are read while
+    /// other threads go on counting, so they may be off by the fixes that
+    /// run meanwhile.
+    /// Is thread-safe.
+    BufferStats get_stats() const;
+
+    /// Prints `get_stats()` to `out` every `interval` from the cleaner thread,
+    /// `nullptr` or an interval of 0 turns it off. `out` must outlive the
+    /// manager or the next call.
+    void set_stats_dump(ostream* out, chrono::milliseconds interval);
+
     /// Returns the page ids of all pages (fixed and unfixed) that are in the
-    /// FIFO list in FIFO order.
-    /// Is not thread-safe.
+    /// FIFO list in FIFO order. The list is walked on every call. Empty
+    /// unless the policy is `TWO_QUEUE`.
+    /// Is thread-safe, the prefetcher changes the lists in the background.
     std::vector<uint64_t> get_fifo_list() const;
 
     /// Returns the page ids of all pages (fixed and unfixed) that are in the
-    /// LRU list in LRU order.
-    /// Is not thread-safe.
+    /// LRU list in LRU order. The list is walked on every call. Empty
+    /// unless the policy is `TWO_QUEUE`.
+    /// Is thread-safe, the prefetcher changes the lists in the background.
     std::vector<uint64_t> get_lru_list() const;
 
     /// Returns the segment id for a given page id which is contained in the 16
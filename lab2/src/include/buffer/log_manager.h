@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "storage/file.h"
+using namespace std;
+namespace buzzdb {
+
+// The log file starts with a LogHeader in a block of its own, the records
+// follow it. LSNs are positions in the file, they never go back while the
+// log is in use; the space of records that are not needed any more is
+// discarded.
+static constexpr uint64_t kLogStart = 4096;
+static constexpr uint64_t kLogMagic = 0x4c4f475a5a5542ull;
+
+// The checkpoint record of the log. Redo starts at redo_lsn, every change
+// before it is in the segment files.
+struct LogHeader {
+    uint64_t magic;
+    uint64_t redo_lsn;
+    uint64_t checksum;      // of magic and redo_lsn
+};
+
+// A redo record holds the bytes of a page after a change, it is followed by
+// them in the log. The LSN of a record is the position in the log right after
+// it, so a page whose last change has LSN l may be written once the log is
+// durable up to l.
+struct LogRecordHeader {
+    uint64_t lsn;
+    uint64_t page_id;
+    uint32_t offset;        // of the bytes in the page
+    uint32_t size;
+    uint64_t checksum;      // of the header with checksum 0 and the bytes
+};
+
+// The write-ahead log of the buffer manager. Records are appended to a
+// buffer in memory, flush() writes them with the records of all threads that
+// are waiting for a flush at the same time and syncs the file once for all
+// of them.
+class LogManager {
+public:
+    // Called by recover() for every record in the log, oldest first.
+    using Redo = function<void(uint64_t lsn, uint64_t page_id, uint32_t offset, const char* data, uint32_t size)>;
+
+    // Opens the log, recover() has to be called before anything is appended.
+    explicit LogManager(const string& filename);
+    // Flushes the records that are left.
+    ~LogManager();
+
+    // Hands the records of the log from the redo LSN of the last checkpoint
+    // on to redo and sets up the log to append to them. A record that was
+    // not written completely and everything after it are cut off.
+    void recover(const Redo& redo);
+    // Called by append() with the LSN of the record while no other thread
+    // can append or get the end of the log.
+    using Appended = function<void(uint64_t lsn)>;
+
+    // Appends a record of size bytes at data, that are at offset in the page,
+    // and returns its LSN. appended, if set, is called before the record can
+    // be seen by get_end_lsn(). Is thread-safe.
+    uint64_t append(uint64_t page_id, uint32_t offset, const char* data, uint32_t size,
+                    const Appended& appended = nullptr);
+    // Returns when the log is durable up to lsn. Is thread-safe.
+    void flush(uint64_t lsn);
+    // Records a checkpoint: the changes before redo_lsn, which is the LSN of
+    // a record or the end of the log, are durable in the segment files.
+    // Recovery starts at redo_lsn then, the records before it are discarded.
+    // Is thread-safe w.r.t. append() and flush(), not w.r.t. itself.
+    void checkpoint(uint64_t redo_lsn);
+    // Drops all records, the pages of all of them have to be durable.
+    void truncate();
+    // The log is durable up to here.
+    uint64_t get_flushed_lsn() const { return flushed_lsn.load(); }
+    // The next record goes here.
+    uint64_t get_end_lsn();
+    // Redo starts here.
+    uint64_t get_redo_lsn() const { return redo_lsn.load(); }
+
+private:
+    unique_ptr<File> file;
+    mutex log_mtx;
+    condition_variable flushed_cv;
+    vector<char> buffer;        // records that are not written yet
+    vector<char> spare;         // a buffer to swap in while a group is written
+    uint64_t buffer_lsn;        // position of buffer in the log
+    uint64_t end_lsn;           // where the next record goes
+    bool flushing;              // a thread writes a group of records
+    atomic<uint64_t> flushed_lsn;
+    atomic<uint64_t> redo_lsn;  // of the last checkpoint
+
+    // Write and sync the header with redo_lsn.
+    void write_header(uint64_t lsn);
+};
+
+}  // namespace buzzdb
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+namespace buzzdb {
+
+// Frames are referred to by their index in the frame table.
+static constexpr uint32_t kNoFrame = UINT32_MAX;
+
+// Replacement policies that BufferManager can be constructed with.
+enum PolicyType {
+    TWO_QUEUE,  // FIFO for pages seen once, LRU for pages seen again
+    CLOCK,      // one reference bit per frame, hits do not take a latch
+    LRU_K,      // evicts the page whose K-th last access is oldest, K = 2
+    ARC         // adaptive replacement cache, balances recency and frequency
+};
+
+// What the buffer manager says about a frame the policy wants to evict.
+enum Candidate {
+    SKIP,       // fixed, look for another frame
+    TAKE,       // evicted, the policy forgets the frame
+    STOP        // stop looking, the buffer manager has to do some I/O first
+};
+
+// Decides which page leaves the buffer. Pages are referred to by the index
+// of their frame. All functions are called under the list latch of the
+// buffer manager, except access() of a policy with lock_free_access().
+class ReplacementPolicy {
+public:
+    virtual ~ReplacementPolicy() = default;
+
+    // A page was read into frame, its first access.
+    virtual void insert(uint32_t frame, uint64_t page_id) = 0;
+    // A page that is in frame was fixed again. True if the page moved from
+    // the pages seen once to the pages seen more often.
+    virtual bool access(uint32_t frame) = 0;
+    // The page in frame left the buffer without being evicted by victim().
+    virtual void remove(uint32_t frame) = 0;
+    // Offer frames to check in eviction order until check returns TAKE or
+    // STOP. Returns the frame that was taken, kNoFrame otherwise.
+    virtual uint32_t victim(const function<Candidate(uint32_t)>& check) = 0;
+    // Up to count frames from the eviction end of every queue of the policy,
+    // for the cleaner.
+    virtual void candidates(size_t count, vector<uint32_t>& frames) const = 0;
+    // True if access() is thread-safe and may be called without the latch.
+    virtual bool lock_free_access() const { return false; }
+    // The frames of a queue of 2Q, oldest first. Empty for other policies.
+    virtual vector<uint32_t> queue(bool fifo) const {
+        (void)fifo;
+        return {};
+    }
+
+    // A policy for a buffer of frame_count frames.
+    static unique_ptr<ReplacementPolicy> make(PolicyType type, size_t frame_count);
+};
+
+// Doubly linked lists of frames that share the link arrays. A frame is in
+// at most one of the lists.
+class FrameLists {
+public:
+    struct List {
+        uint32_t head;      // newest
+        uint32_t tail;      // oldest
+        size_t size;
+    };
+
+    explicit FrameLists(size_t frame_count);
+    static List make_list();
+    void push_head(List& list, uint32_t frame);
+    void erase(List& list, uint32_t frame);
+    uint32_t prev(uint32_t frame) const { return prev_frame[frame]; }
+
+private:
+    vector<uint32_t> prev_frame;
+    vector<uint32_t> next_frame;
+};
+
+class TwoQueuePolicy : public ReplacementPolicy {
+public:
+    explicit TwoQueuePolicy(size_t frame_count);
+    void insert(uint32_t frame, uint64_t page_id) override;
+    bool access(uint32_t frame) override;
+    void remove(uint32_t frame) override;
+    uint32_t victim(const function<Candidate(uint32_t)>& check) override;
+    void candidates(size_t count, vector<uint32_t>& frames) const override;
+    vector<uint32_t> queue(bool fifo) const override;
+
+private:
+    FrameLists links;
+    FrameLists::List fifo_list;
+    FrameLists::List lru_list;
+    vector<bool> in_fifo;
+};
+
+class ClockPolicy : public ReplacementPolicy {
+public:
+    explicit ClockPolicy(size_t frame_count);
+    void insert(uint32_t frame, uint64_t page_id) override;
+    bool access(uint32_t frame) override;
+    void remove(uint32_t frame) override;
+    uint32_t victim(const function<Candidate(uint32_t)>& check) override;
+    void candidates(size_t count, vector<uint32_t>& frames) const override;
+    bool lock_free_access() const override { return true; }
+
+private:
+    size_t frame_count;
+    size_t hand;
+    vector<bool> resident;
+    unique_ptr<atomic<bool>[]> referenced;
+};
+
+class LruKPolicy : public ReplacementPolicy {
+public:
+    static constexpr size_t K = 2;
+
+    explicit LruKPolicy(size_t frame_count);
+    void insert(uint32_t frame, uint64_t page_id) override;
+    bool access(uint32_t frame) override;
+    void remove(uint32_t frame) override;
+    uint32_t victim(const function<Candidate(uint32_t)>& check) override;
+    void candidates(size_t count, vector<uint32_t>& frames) const override;
+
+private:
+    // (K-th last access, last access, frame), a page with less than K
+    // accesses has K-th last access 0 and goes first, in LRU order.
+    using Key = tuple<uint64_t, uint64_t, uint32_t>;
+    Key key_of(uint32_t frame) const;
+
+    uint64_t clock;
+    vector<array<uint64_t, K>> history;    // last accesses, newest first
+    set<Key> order;
+};
+
+class ArcPolicy : public ReplacementPolicy {
+public:
+    explicit ArcPolicy(size_t frame_count);
+    void insert(uint32_t frame, uint64_t page_id) override;
+    bool access(uint32_t frame) override;
+    void remove(uint32_t frame) override;
+    uint32_t victim(const function<Candidate(uint32_t)>& check) override;
+    void candidates(size_t count, vector<uint32_t>& frames) const override;
+
+private:
+    // Page ids of recently evicted pages, newest first.
+    struct Ghosts {
+        list<uint64_t> pages;
+        unordered_map<uint64_t, list<uint64_t>::iterator> index;
+        bool erase(uint64_t page_id);
+        void push_head(uint64_t page_id);
+        void pop_tail();
+    };
+
+    uint32_t victim_from(FrameLists::List& list, bool recent, const function<Candidate(uint32_t)>& check, bool& stop);
+
+    size_t capacity;
+    size_t target;          // p of ARC, the size that T1 should have
+    FrameLists links;
+    FrameLists::List t1;    // pages seen once recently
+    FrameLists::List t2;    // pages seen at least twice recently
+    Ghosts b1;              // evicted from t1
+    Ghosts b2;              // evicted from t2
+    vector<uint8_t> in_list;    // 1 for t1, 2 for t2
+    vector<uint64_t> page_of;
+};
+
+}  // namespace buzzdb
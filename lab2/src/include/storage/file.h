@@ -59,10 +59,98 @@ class File {
   /// @param[in] size   The size of the block.
   virtual void write_block(const char* block, size_t offset, size_t size) = 0;
 
+  /// Writes `count` blocks of `size` bytes each to consecutive places in the
+  /// file, starting at `offset`. Implementations should write them with as
+  /// few system calls as possible.
+  /// Is thread-safe w.r.t concurrent calls to `read_block()` and
+  /// `write_block()`.
+  /// @param[in] blocks Pointers to the `count` blocks in file order.
+  /// @param[in] count  The number of blocks.
+  /// @param[in] offset The offset in the file of the first block.
+  /// @param[in] size   The size of every block.
+  virtual void write_blocks(const char* const* blocks, size_t count,
+                            size_t offset, size_t size) {
+    for (size_t i = 0; i < count; ++i) {
+      write_block(blocks[i], offset + i * size, size);
+    }
+  }
+
+  /// Makes the data written so far durable. Files opened for direct I/O or
+  /// without `write_through` need it, other files write through to the disk
+  /// on every write.
+  virtual void sync() {}
+
+  /// Tells the file that `size` bytes at `offset` are not needed any more,
+  /// so that it can free their space. They read as zeros afterwards, the
+  /// size of the file does not change. The default implementation keeps
+  /// them.
+  virtual void discard(size_t offset, size_t size) {
+    (void)offset;
+    (void)size;
+  }
+  /// Identifies an I/O that was started by one of the `submit_*()` functions.
+  using Ticket = uint64_t;
+
+  /// Starts to read a block of the file and returns without waiting for it.
+  /// `block` must stay valid until `wait()` returned for the ticket, and
+  /// every ticket must be waited for exactly once. The default
+  /// implementation reads the block before it returns.
+  /// Is thread-safe w.r.t concurrent calls to all block functions.
+  virtual Ticket submit_read(size_t offset, size_t size, char* block) {
+    read_block(offset, size, block);
+    return 0;
+  }
+
+  /// Starts to write a block of the file, see `submit_read()`.
+  virtual Ticket submit_write(const char* block, size_t offset, size_t size) {
+    write_block(block, offset, size);
+    return 0;
+  }
+
+  /// Starts to write consecutive blocks, see `write_blocks()` and
+  /// `submit_read()`. `blocks` itself may be freed when this returns.
+  virtual Ticket submit_write_blocks(const char* const* blocks, size_t count,
+                                     size_t offset, size_t size) {
+    write_blocks(blocks, count, offset, size);
+    return 0;
+  }
+
+  /// Waits until the I/O of `ticket` is done. Throws the error of the I/O if
+  /// it failed, and `std::invalid_argument` if the ticket is not pending.
+  virtual void wait(Ticket ticket) { (void)ticket; }
+
+  /// Tells the file that blocks are mostly read into or written from the
+  /// memory at `base`, so that it can prepare the memory once instead of on
+  /// every I/O. Returns false if the file does not use it. Must not be called
+  /// while I/O is in progress.
+  virtual bool register_buffer(char* base, size_t size) {
+    (void)base;
+    (void)size;
+    return false;
+  }
+
   /// Opens a file with the given mode. Existing files are never overwritten.
   /// @param[in] filename Path to the file.
   /// @param[in] mode     `Mode` that should be used to open the file.
-  static std::unique_ptr<File> open_file(const char* filename, Mode mode);
+  /// @param[in] direct   Bypass the page cache of the kernel (O_DIRECT).
+  ///                     Blocks, their offsets and sizes must be aligned to
+  ///                     the logical block size of the disk then, and
+  ///                     writes are only durable after `sync()`.
+  /// @param[in] write_through Every write is durable when it returns
+  ///                     (O_SYNC). Otherwise writes are only durable after
+  ///                     `sync()`. Direct I/O never writes through.
+  static std::unique_ptr<File> open_file(const char* filename, Mode mode,
+                                         bool direct = false,
+                                         bool write_through = true);
+
+  /// Opens a file like `open_file()` whose I/O is done through an io_uring
+  /// with room for `queue_depth` I/Os in flight. The `submit_*()` functions
+  /// return as soon as the I/O is queued in the kernel. Falls back to
+  /// `open_file()` if the kernel does not support io_uring.
+  static std::unique_ptr<File> open_uring_file(const char* filename, Mode mode,
+                                               unsigned queue_depth = 64,
+                                               bool direct = false,
+                                               bool write_through = true);
 
   /// Opens a temporary file in `WRITE` mode. The file will be deleted
   /// automatically after use.
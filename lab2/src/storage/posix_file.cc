@@ -1,12 +1,25 @@
 
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
 #include <stdlib.h>  // NOLINT
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <system_error>
+#include <unordered_map>
+#include <vector>
 
 #include "storage/file.h"
 
@@ -38,13 +51,22 @@ class PosixFile : public File {
   PosixFile(Mode mode, int fd, size_t size)
       : mode(mode), fd(fd), cached_size(size) {}
 
-  PosixFile(const char* filename, Mode mode) : mode(mode) {
+  PosixFile(const char* filename, Mode mode, bool direct = false,
+            bool write_through = true)
+      : mode(mode) {
+    // Direct I/O is made durable by sync(), not by every write.
+    int flags = direct ? O_DIRECT : (write_through ? O_SYNC : 0);
     switch (mode) {
       case READ:
-        fd = ::open(filename, O_RDONLY | O_SYNC);
+        fd = ::open(filename, O_RDONLY | flags);
         break;
       case WRITE:
-        fd = ::open(filename, O_RDWR | O_CREAT | O_SYNC, 0666);
+        fd = ::open(filename, O_RDWR | O_CREAT | flags, 0666);
+    }
+    if (fd < 0 && direct && errno == EINVAL) {
+      // The file system does not support O_DIRECT (e.g. tmpfs), the page
+      // cache is used then, still without syncing every write.
+      fd = ::open(filename, mode == READ ? O_RDONLY : O_RDWR | O_CREAT, 0666);
     }
     if (fd < 0) {
       throw_errno();
@@ -61,6 +83,26 @@ class PosixFile : public File {
 
   Mode get_mode() const override { return mode; }
 
+  int get_fd() const { return fd; }
+
+  void sync() override {
+    if (::fdatasync(fd) < 0) {
+      throw_errno();
+    }
+  }
+
+  void discard(size_t offset, size_t size) override {
+    if (size == 0) {
+      return;
+    }
+    // Not every file system can punch holes, the bytes stay then.
+    if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                    size) < 0 &&
+        errno != EOPNOTSUPP) {
+      throw_errno();
+    }
+  }
+
   size_t size() const override { return cached_size; }
 
   void resize(size_t new_size) override {
@@ -81,7 +123,9 @@ class PosixFile : public File {
                   offset + total_bytes_read);
       if (bytes_read == 0) {
         // end of file, i.e. size was probably larger than the file
-        // size
+        // size. The missing part reads as zeros, as it would after a
+        // resize().
+        std::memset(block + total_bytes_read, 0, size - total_bytes_read);
         return;
       }
       if (bytes_read < 0) {
@@ -108,10 +152,415 @@ class PosixFile : public File {
       total_bytes_written += static_cast<size_t>(bytes_written);
     }
   }
+
+  void write_blocks(const char* const* blocks, size_t count, size_t offset,
+                    size_t size) override {
+    std::vector<struct iovec> vecs(count);
+    for (size_t i = 0; i < count; ++i) {
+      vecs[i].iov_base = const_cast<char*>(blocks[i]);
+      vecs[i].iov_len = size;
+    }
+    size_t first = 0;
+    while (first < count) {
+      int vec_count = static_cast<int>(std::min<size_t>(count - first, IOV_MAX));
+      ssize_t bytes_written =
+          ::pwritev(fd, vecs.data() + first, vec_count, offset);
+      if (bytes_written == 0) {
+        // See write_block().
+        return;
+      }
+      if (bytes_written < 0) {
+        throw_errno();
+      }
+      offset += static_cast<size_t>(bytes_written);
+      // Skip the blocks that were written completely, a partial write of a
+      // block continues in the middle of it.
+      size_t written = static_cast<size_t>(bytes_written);
+      while (first < count && written >= vecs[first].iov_len) {
+        written -= vecs[first].iov_len;
+        ++first;
+      }
+      if (first < count) {
+        vecs[first].iov_base = static_cast<char*>(vecs[first].iov_base) + written;
+        vecs[first].iov_len -= written;
+      }
+    }
+  }
+};
+
+/// The rings of an io_uring that are shared with the kernel, set up with the
+/// raw system calls.
+class Ring {
+ public:
+  Ring() = default;
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+
+  ~Ring() {
+    if (sqes != nullptr) ::munmap(sqes, sqes_size);
+    if (cq_ptr != nullptr && cq_ptr != sq_ptr) ::munmap(cq_ptr, cq_size);
+    if (sq_ptr != nullptr) ::munmap(sq_ptr, sq_size);
+    if (fd >= 0) ::close(fd);
+  }
+
+  /// Sets up a ring with `entries` submission entries. Returns false if the
+  /// kernel does not allow it.
+  bool setup(unsigned entries) {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0) {
+      return false;
+    }
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes +
+              params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+    sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+    cq_ptr = single_mmap ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes_ptr = map(sqes_size, IORING_OFF_SQES);
+    if (sq_ptr == nullptr || cq_ptr == nullptr || sqes_ptr == nullptr) {
+      return false;
+    }
+    sqes = static_cast<struct io_uring_sqe*>(sqes_ptr);
+    char* sq = static_cast<char*>(sq_ptr);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    entries_ = params.sq_entries;
+    return true;
+  }
+
+  unsigned entries() const { return entries_; }
+
+  /// Returns the next submission entry, cleared. The caller makes sure that
+  /// no more than `entries()` I/Os are in flight, and the kernel consumes
+  /// every entry in `submit()`, so there is always room.
+  struct io_uring_sqe* next_sqe() {
+    unsigned tail = *sq_tail;
+    unsigned index = tail & sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+  }
+
+  /// Hands the entry from `next_sqe()` to the kernel.
+  void submit() {
+    while (::syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) < 0) {
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        throw_errno();
+      }
+    }
+  }
+
+  /// Blocks until at least one completion is available.
+  void wait_completion() {
+    ::syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr,
+              0);
+  }
+
+  /// Calls `handle(user_data, res)` for every available completion and
+  /// returns how many there were.
+  template <typename Handle>
+  unsigned reap(Handle&& handle) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = tail - head;
+    for (; head != tail; ++head) {
+      struct io_uring_cqe* cqe = &cqes[head & cq_mask];
+      handle(cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+  bool register_buffer(char* base, size_t size) {
+    struct iovec vec = {base, size};
+    return ::syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+                     &vec, 1) == 0;
+  }
+
+ private:
+  void* map(size_t size, off_t offset) {
+    void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+  }
+
+  int fd = -1;
+  unsigned entries_ = 0;
+  void* sq_ptr = nullptr;
+  void* cq_ptr = nullptr;
+  size_t sq_size = 0;
+  size_t cq_size = 0;
+  size_t sqes_size = 0;
+  struct io_uring_sqe* sqes = nullptr;
+  unsigned* sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  unsigned* sq_array = nullptr;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  struct io_uring_cqe* cqes = nullptr;
 };
 
-std::unique_ptr<File> File::open_file(const char* filename, Mode mode) {
-  return std::make_unique<PosixFile>(filename, mode);
+/// A `PosixFile` that does its I/O through an io_uring. Reads and writes of
+/// a registered buffer use the fixed buffer operations, so the kernel does
+/// not pin the pages on every I/O. The blocking functions submit the I/O and
+/// wait for it.
+///
+/// The ring is shared by all threads: `ring_mutex` protects submissions and
+/// completions, and only one thread at a time waits for completions in the
+/// kernel. The others wait for `completed` to be notified, so no completion
+/// is consumed while a thread sleeps in the kernel for it.
+class UringFile : public PosixFile {
+ private:
+  struct Request {
+    bool write;
+    std::vector<struct iovec> vecs;
+    size_t offset;
+    size_t size;  // bytes of all vecs
+    bool done = false;
+    int error = 0;
+  };
+
+  std::unique_ptr<Ring> ring;
+  std::mutex ring_mutex;
+  std::condition_variable completed;
+  bool reaping = false;
+  unsigned in_flight = 0;
+  Ticket next_ticket = 1;
+  std::unordered_map<Ticket, Request> requests;
+  char* buffer_base = nullptr;
+  size_t buffer_size = 0;
+
+  bool in_buffer(const char* block, size_t size) const {
+    return buffer_base != nullptr && block >= buffer_base &&
+           block + size <= buffer_base + buffer_size;
+  }
+
+  /// Queues a request in the ring, `ring_mutex` is held.
+  Ticket submit(std::unique_lock<std::mutex>& lock, Request&& request) {
+    while (in_flight >= ring->entries()) {
+      await_completion(lock);
+    }
+    Ticket ticket = next_ticket++;
+    Request& queued = requests.emplace(ticket, std::move(request)).first->second;
+    struct io_uring_sqe* sqe = ring->next_sqe();
+    sqe->fd = get_fd();
+    sqe->off = queued.offset;
+    sqe->user_data = ticket;
+    if (queued.vecs.size() > 1) {
+      sqe->opcode = queued.write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->addr = reinterpret_cast<uint64_t>(queued.vecs.data());
+      sqe->len = static_cast<uint32_t>(queued.vecs.size());
+    } else {
+      char* block = static_cast<char*>(queued.vecs[0].iov_base);
+      bool fixed = in_buffer(block, queued.size);
+      if (queued.write) {
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+      } else {
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      }
+      sqe->addr = reinterpret_cast<uint64_t>(block);
+      sqe->len = static_cast<uint32_t>(queued.size);
+      sqe->buf_index = 0;
+    }
+    ++in_flight;
+    try {
+      ring->submit();
+    } catch (...) {
+      --in_flight;
+      requests.erase(ticket);
+      throw;
+    }
+    return ticket;
+  }
+
+  /// Records a completion, `ring_mutex` is held.
+  void complete(Ticket ticket, int result) {
+    auto it = requests.find(ticket);
+    if (it == requests.end()) {
+      // Its submission failed, see submit().
+      return;
+    }
+    --in_flight;
+    Request& request = it->second;
+    request.done = true;
+    if (result < 0) {
+      request.error = -result;
+    } else if (static_cast<size_t>(result) < request.size) {
+      // Short transfers are rare for files, the rest is done synchronously
+      // when the request is waited for.
+      request.error = -result - 1;
+    }
+  }
+
+  /// Finishes a request after a short transfer of `done` bytes.
+  void finish(Request& request, size_t done) {
+    size_t offset = request.offset;
+    for (struct iovec& vec : request.vecs) {
+      char* block = static_cast<char*>(vec.iov_base);
+      size_t skip = std::min(done, vec.iov_len);
+      done -= skip;
+      if (skip < vec.iov_len) {
+        if (request.write) {
+          PosixFile::write_block(block + skip, offset + skip, vec.iov_len - skip);
+        } else {
+          PosixFile::read_block(offset + skip, vec.iov_len - skip, block + skip);
+        }
+      }
+      offset += vec.iov_len;
+    }
+  }
+
+  /// Reaps the available completions or, if there are none, waits for the
+  /// next one. `ring_mutex` is held.
+  void await_completion(std::unique_lock<std::mutex>& lock) {
+    if (reaping) {
+      completed.wait(lock);
+      return;
+    }
+    auto handle = [this](uint64_t ticket, int result) { complete(ticket, result); };
+    if (ring->reap(handle) == 0) {
+      reaping = true;
+      lock.unlock();
+      ring->wait_completion();
+      lock.lock();
+      reaping = false;
+      ring->reap(handle);
+    }
+    completed.notify_all();
+  }
+
+  static Request make_request(bool write, const char* block, size_t offset,
+                              size_t size) {
+    Request request;
+    request.write = write;
+    request.vecs.push_back({const_cast<char*>(block), size});
+    request.offset = offset;
+    request.size = size;
+    return request;
+  }
+
+ public:
+  UringFile(const char* filename, Mode mode, bool direct, bool write_through,
+            std::unique_ptr<Ring> ring)
+      : PosixFile(filename, mode, direct, write_through),
+        ring(std::move(ring)) {}
+
+  ~UringFile() override {
+    // The kernel may still write into blocks of requests that were never
+    // waited for.
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    while (in_flight > 0) {
+      await_completion(lock);
+    }
+  }
+
+  void read_block(size_t offset, size_t size, char* block) override {
+    wait(submit_read(offset, size, block));
+  }
+
+  void write_block(const char* block, size_t offset, size_t size) override {
+    wait(submit_write(block, offset, size));
+  }
+
+  void write_blocks(const char* const* blocks, size_t count, size_t offset,
+                    size_t size) override {
+    wait(submit_write_blocks(blocks, count, offset, size));
+  }
+
+  Ticket submit_read(size_t offset, size_t size, char* block) override {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    return submit(lock, make_request(false, block, offset, size));
+  }
+
+  Ticket submit_write(const char* block, size_t offset, size_t size) override {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    return submit(lock, make_request(true, block, offset, size));
+  }
+
+  Ticket submit_write_blocks(const char* const* blocks, size_t count,
+                             size_t offset, size_t size) override {
+    Request request;
+    request.write = true;
+    request.offset = offset;
+    request.size = count * size;
+    if (count == 0 || count > IOV_MAX) {
+      // More blocks than one request takes, they are written synchronously.
+      PosixFile::write_blocks(blocks, count, offset, size);
+      request.done = true;
+      std::unique_lock<std::mutex> lock(ring_mutex);
+      Ticket ticket = next_ticket++;
+      requests.emplace(ticket, std::move(request));
+      return ticket;
+    }
+    request.vecs.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      request.vecs[i] = {const_cast<char*>(blocks[i]), size};
+    }
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    return submit(lock, std::move(request));
+  }
+
+  void wait(Ticket ticket) override {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    auto it = requests.find(ticket);
+    if (it == requests.end()) {
+      throw std::invalid_argument{"unknown or already waited for ticket"};
+    }
+    while (!it->second.done) {
+      await_completion(lock);
+      it = requests.find(ticket);
+    }
+    Request request = std::move(it->second);
+    requests.erase(it);
+    lock.unlock();
+    if (request.error < 0) {
+      // A short transfer, see complete().
+      finish(request, static_cast<size_t>(-(request.error + 1)));
+    } else if (request.error > 0) {
+      throw std::system_error{request.error, std::system_category()};
+    }
+  }
+
+  bool register_buffer(char* base, size_t size) override {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    if (!ring->register_buffer(base, size)) {
+      return false;
+    }
+    buffer_base = base;
+    buffer_size = size;
+    return true;
+  }
+};
+
+std::unique_ptr<File> File::open_file(const char* filename, Mode mode,
+                                      bool direct, bool write_through) {
+  return std::make_unique<PosixFile>(filename, mode, direct, write_through);
+}
+
+std::unique_ptr<File> File::open_uring_file(const char* filename, Mode mode,
+                                            unsigned queue_depth, bool direct,
+                                            bool write_through) {
+  auto ring = std::make_unique<Ring>();
+  if (!ring->setup(queue_depth)) {
+    return open_file(filename, mode, direct, write_through);
+  }
+  return std::make_unique<UringFile>(filename, mode, direct, write_through,
+                                     std::move(ring));
 }
 
 std::unique_ptr<File> File::make_temporary_file() {
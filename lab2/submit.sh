@@ -12,7 +12,7 @@ function verify() {
 		done
 }
 
-req_files=("src/include/buffer/buffer_manager.h" "src/buffer/buffer_manager.cc")
+req_files=("src/include/buffer/buffer_manager.h" "src/buffer/buffer_manager.cc" "src/include/storage/file.h" "src/storage/posix_file.cc" "src/include/buffer/replacement_policy.h" "src/buffer/replacement_policy.cc" "src/include/buffer/log_manager.h" "src/buffer/log_manager.cc")
 verify "${req_files[@]}"	
 if [[ $? -ne 0 ]]; then
     exit 1
@@ -20,7 +20,7 @@ fi
 
 if [ $# -eq 1 ]
 then
-	zip "${1}.zip" src/buffer/buffer_manager.cc src/include/buffer/buffer_manager.h REPORT.md
+	zip "${1}.zip" src/buffer/buffer_manager.cc src/include/buffer/buffer_manager.h src/storage/posix_file.cc src/include/storage/file.h src/buffer/replacement_policy.cc src/include/buffer/replacement_policy.h src/buffer/log_manager.cc src/include/buffer/log_manager.h REPORT.md
 else
 	echo 'Please provide a file name, eg ./submit Gaurav'
 fi
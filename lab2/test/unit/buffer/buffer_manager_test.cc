@@ -1,9 +1,17 @@
 #include <gtest/gtest.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <csignal>
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
+#include <fstream>
 #include <memory>
 #include <random>
+#include <sstream>
+#include <stdexcept>
 #include <thread>
 #include <vector>
 
@@ -11,6 +19,18 @@
 using namespace std;
 namespace {
 
+// Polls condition until it holds or five seconds passed, for the work of the
+// background threads. Returns whether it held.
+template <typename Condition>
+bool Eventually(Condition condition) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (!condition()) {
+    if (std::chrono::steady_clock::now() >= deadline) return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
 TEST(BufferManagerTest, FixSingle) {
   buzzdb::BufferManager buffer_manager{1024, 10};
   std::vector<uint64_t> expected_values(1024 / sizeof(uint64_t), 123);
@@ -60,6 +80,325 @@ TEST(BufferManagerTest, PersistentRestart) {
   }
 }
 
+TEST(BufferManagerTest, AsyncIoRestart) {
+  auto buffer_manager = std::make_unique<buzzdb::BufferManager>(1024, 10, true);
+  for (uint64_t segment_page = 0; segment_page < 30; ++segment_page) {
+    auto& page = buffer_manager->fix_page(segment_page, true);
+    *reinterpret_cast<uint64_t*>(page.get_data()) = 7 * segment_page;
+    buffer_manager->unfix_page(page, true);
+  }
+  buffer_manager = std::make_unique<buzzdb::BufferManager>(1024, 10, true);
+  for (uint64_t segment_page = 0; segment_page < 30; ++segment_page) {
+    auto& page = buffer_manager->fix_page(segment_page, false);
+    uint64_t value = *reinterpret_cast<uint64_t*>(page.get_data());
+    buffer_manager->unfix_page(page, false);
+    EXPECT_EQ(7 * segment_page, value);
+  }
+}
+
+TEST(BufferManagerTest, DirectIoRestart) {
+  EXPECT_THROW(buzzdb::BufferManager(1024, 10, false, true), std::invalid_argument);
+  auto buffer_manager = std::make_unique<buzzdb::BufferManager>(4096, 10, true, true);
+  for (uint64_t segment_page = 0; segment_page < 30; ++segment_page) {
+    auto& page = buffer_manager->fix_page((uint64_t{1} << 48) | segment_page, true);
+    *reinterpret_cast<uint64_t*>(page.get_data()) = 11 * segment_page;
+    buffer_manager->unfix_page(page, true);
+  }
+  buffer_manager = std::make_unique<buzzdb::BufferManager>(4096, 10, false, true);
+  for (uint64_t segment_page = 0; segment_page < 30; ++segment_page) {
+    auto& page = buffer_manager->fix_page((uint64_t{1} << 48) | segment_page, false);
+    uint64_t value = *reinterpret_cast<uint64_t*>(page.get_data());
+    buffer_manager->unfix_page(page, false);
+    EXPECT_EQ(11 * segment_page, value);
+  }
+}
+
+TEST(BufferManagerTest, WriteAheadLogRedo) {
+  std::remove("7");
+  std::remove("wal_test.log");
+  std::remove("wal_test_copy.log");
+  {
+    buzzdb::BufferManager buffer_manager{1024, 10, false, false, buzzdb::TWO_QUEUE, "wal_test.log"};
+    std::vector<std::thread> threads;
+    for (uint64_t thread = 0; thread < 4; ++thread) {
+      threads.emplace_back([&buffer_manager, thread] {
+        for (uint64_t i = 1; i <= 100; ++i) {
+          auto& page = buffer_manager.fix_page((uint64_t{7} << 48) | thread, true);
+          *reinterpret_cast<uint64_t*>(page.get_data() + 8 * thread) = i;
+          uint64_t lsn = buffer_manager.log_page(page, 8 * thread, 8);
+          buffer_manager.unfix_page(page, true);
+          buffer_manager.commit(lsn);
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+    // The log of a crash right after the commits, plus a torn record.
+    std::ifstream log("wal_test.log", std::ios::binary);
+    std::ofstream copy("wal_test_copy.log", std::ios::binary);
+    copy << log.rdbuf() << "torn";
+  }
+  // The pages never reached the disk.
+  std::remove("7");
+  {
+    buzzdb::BufferManager buffer_manager{1024, 10, false, false, buzzdb::TWO_QUEUE, "wal_test_copy.log"};
+    for (uint64_t thread = 0; thread < 4; ++thread) {
+      auto& page = buffer_manager.fix_page((uint64_t{7} << 48) | thread, false);
+      uint64_t value = *reinterpret_cast<uint64_t*>(page.get_data() + 8 * thread);
+      buffer_manager.unfix_page(page, false);
+      EXPECT_EQ(100, value);
+    }
+  }
+  std::ifstream log("wal_test_copy.log", std::ios::binary | std::ios::ate);
+  EXPECT_EQ(buzzdb::kLogStart, static_cast<uint64_t>(log.tellg()));
+  {
+    buzzdb::BufferManager buffer_manager{1024, 10};
+    for (uint64_t thread = 0; thread < 4; ++thread) {
+      auto& page = buffer_manager.fix_page((uint64_t{7} << 48) | thread, false);
+      uint64_t value = *reinterpret_cast<uint64_t*>(page.get_data() + 8 * thread);
+      buffer_manager.unfix_page(page, false);
+      EXPECT_EQ(100, value);
+    }
+  }
+  std::remove("7");
+  std::remove("wal_test.log");
+  std::remove("wal_test_copy.log");
+}
+
+TEST(BufferManagerTest, CheckpointShortensRedo) {
+  std::remove("7");
+  std::remove("wal_test.log");
+  std::remove("wal_test_copy.log");
+  std::remove("7_copy");
+  auto copy_file = [](const char* from, const char* to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary);
+    out << in.rdbuf();
+  };
+  auto write = [](buzzdb::BufferManager& buffer_manager, uint64_t segment_page, uint64_t value) {
+    auto& page = buffer_manager.fix_page((uint64_t{7} << 48) | segment_page, true);
+    *reinterpret_cast<uint64_t*>(page.get_data()) = value;
+    uint64_t lsn = buffer_manager.log_page(page, 0, 8);
+    buffer_manager.unfix_page(page, true);
+    buffer_manager.commit(lsn);
+  };
+  {
+    buzzdb::BufferManager buffer_manager{1024, 10, false, false, buzzdb::TWO_QUEUE, "wal_test.log"};
+    for (uint64_t segment_page = 0; segment_page < 4; ++segment_page) {
+      write(buffer_manager, segment_page, 1);
+    }
+    buffer_manager.checkpoint();
+    // The segment file holds all pages now, only the next change is redone.
+    copy_file("7", "7_copy");
+    write(buffer_manager, 0, 2);
+    copy_file("wal_test.log", "wal_test_copy.log");
+  }
+  std::remove("7");
+  std::rename("7_copy", "7");
+  {
+    buzzdb::BufferManager buffer_manager{1024, 10, false, false, buzzdb::TWO_QUEUE, "wal_test_copy.log"};
+    EXPECT_EQ(1, buffer_manager.get_stats().misses);
+    for (uint64_t segment_page = 0; segment_page < 4; ++segment_page) {
+      auto& page = buffer_manager.fix_page((uint64_t{7} << 48) | segment_page, false);
+      uint64_t value = *reinterpret_cast<uint64_t*>(page.get_data());
+      buffer_manager.unfix_page(page, false);
+      EXPECT_EQ(segment_page == 0 ? 2 : 1, value);
+    }
+  }
+  std::remove("7");
+  std::remove("wal_test.log");
+  std::remove("wal_test_copy.log");
+}
+
+TEST(BufferManagerTest, CheckpointDuringChanges) {
+  std::remove("7");
+  std::remove("7_copy");
+  std::remove("wal_test.log");
+  std::remove("wal_test_copy.log");
+  auto copy_file = [](const char* from, const char* to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary);
+    out << in.rdbuf();
+  };
+  // Every change goes to a slot of its own, so a record that a checkpoint
+  // dropped too early is not covered by a later one.
+  constexpr uint64_t kPages = 4;
+  constexpr uint64_t kChanges = kPages * 1024 / 8;
+  {
+    buzzdb::BufferManager buffer_manager{1024, 10, false, false, buzzdb::TWO_QUEUE, "wal_test.log"};
+    std::atomic<bool> done{false};
+    uint64_t last_lsn = 0;
+    std::thread writer([&] {
+      for (uint64_t i = 0; i < kChanges; ++i) {
+        auto& page = buffer_manager.fix_page((uint64_t{7} << 48) | (i % kPages), true);
+        size_t offset = 8 * (i / kPages);
+        *reinterpret_cast<uint64_t*>(page.get_data() + offset) = i + 1;
+        last_lsn = buffer_manager.log_page(page, offset, 8);
+        buffer_manager.unfix_page(page, true);
+      }
+      done = true;
+    });
+    while (!done) buffer_manager.checkpoint();
+    writer.join();
+    buffer_manager.commit(last_lsn);
+    // A crash now, the pages that are still dirty never reach the disk.
+    copy_file("7", "7_copy");
+    copy_file("wal_test.log", "wal_test_copy.log");
+  }
+  std::remove("7");
+  std::rename("7_copy", "7");
+  {
+    buzzdb::BufferManager buffer_manager{1024, 10, false, false, buzzdb::TWO_QUEUE, "wal_test_copy.log"};
+    for (uint64_t i = 0; i < kChanges; ++i) {
+      auto& page = buffer_manager.fix_page((uint64_t{7} << 48) | (i % kPages), false);
+      uint64_t value = *reinterpret_cast<uint64_t*>(page.get_data() + 8 * (i / kPages));
+      buffer_manager.unfix_page(page, false);
+      ASSERT_EQ(i + 1, value);
+    }
+  }
+  std::remove("7");
+  std::remove("wal_test.log");
+  std::remove("wal_test_copy.log");
+}
+
+TEST(BufferManagerTest, ReadAhead) {
+  buzzdb::BufferManager buffer_manager{1024, 64};
+  buffer_manager.set_read_ahead(8);
+  uint64_t segment = uint64_t{2} << 48;
+  for (uint64_t segment_page = 0; segment_page < 4; ++segment_page) {
+    auto& page = buffer_manager.fix_page(segment | segment_page, false);
+    buffer_manager.unfix_page(page, false);
+  }
+  buffer_manager.prefetch_pages(segment | 100, 4);
+  std::vector<uint64_t> expected_fifo;
+  for (uint64_t segment_page = 0; segment_page < 12; ++segment_page) {
+    expected_fifo.push_back(segment | segment_page);
+  }
+  for (uint64_t segment_page = 100; segment_page < 104; ++segment_page) {
+    expected_fifo.push_back(segment | segment_page);
+  }
+  std::vector<uint64_t> fifo;
+  EXPECT_TRUE(Eventually([&] {
+    fifo = buffer_manager.get_fifo_list();
+    std::sort(fifo.begin(), fifo.end());
+    return fifo == expected_fifo;
+  }));
+  EXPECT_EQ(expected_fifo, fifo);
+  // The first fix of a prefetched page is its first access.
+  for (int i = 0; i < 2; ++i) {
+    auto& page = buffer_manager.fix_page(segment | 100, false);
+    buffer_manager.unfix_page(page, false);
+    EXPECT_EQ(static_cast<size_t>(i), buffer_manager.get_lru_list().size());
+  }
+}
+
+TEST(BufferManagerTest, BackgroundCleaner) {
+  buzzdb::BufferManager buffer_manager{1024, 10};
+  for (uint64_t segment_page = 0; segment_page < 10; ++segment_page) {
+    uint64_t page_id = (uint64_t{3} << 48) | segment_page;
+    auto& page = buffer_manager.fix_page(page_id, true);
+    *reinterpret_cast<uint64_t*>(page.get_data()) = 100 + segment_page;
+    buffer_manager.unfix_page(page, true);
+  }
+  // The cleaner writes the dirty pages while they are still buffered, so
+  // another buffer manager reads them from disk.
+  EXPECT_TRUE(Eventually([] {
+    std::ifstream segment{"3", std::ios::binary};
+    for (uint64_t segment_page = 0; segment_page < 10; ++segment_page) {
+      uint64_t value = 0;
+      segment.seekg(segment_page * 1024);
+      segment.read(reinterpret_cast<char*>(&value), sizeof(value));
+      if (!segment || value != 100 + segment_page) return false;
+    }
+    return true;
+  }));
+  buzzdb::BufferManager other_manager{1024, 10};
+  for (uint64_t segment_page = 0; segment_page < 10; ++segment_page) {
+    uint64_t page_id = (uint64_t{3} << 48) | segment_page;
+    auto& page = other_manager.fix_page(page_id, false);
+    uint64_t value = *reinterpret_cast<uint64_t*>(page.get_data());
+    other_manager.unfix_page(page, false);
+    EXPECT_EQ(100 + segment_page, value);
+  }
+}
+
+TEST(BufferManagerTest, NewPagesAreZeroed) {
+  buzzdb::BufferManager buffer_manager{1024, 1};
+  uint64_t page_id = uint64_t{2} << 48;
+  {
+    auto& page = buffer_manager.fix_page(page_id + 1000, true);
+    std::memset(page.get_data(), 0xff, 1024);
+    buffer_manager.unfix_page(page, false);
+  }
+  // The frame is reused for a page behind the end of the segment file.
+  auto& page = buffer_manager.fix_page(page_id + 2000, false);
+  std::vector<char> expected(1024, 0);
+  EXPECT_EQ(0, std::memcmp(expected.data(), page.get_data(), 1024));
+  buffer_manager.unfix_page(page, false);
+}
+
+TEST(BufferManagerTest, ReadErrorReleasesFrame) {
+  buzzdb::BufferManager buffer_manager{1024, 1};
+  // A directory in place of the segment file makes the read fail.
+  std::remove("9");
+  ASSERT_EQ(0, ::mkdir("9", 0755));
+  uint64_t page_id = uint64_t{9} << 48;
+  EXPECT_THROW(buffer_manager.fix_page(page_id, false), std::exception);
+  EXPECT_THROW(buffer_manager.fix_page(page_id, true), std::exception);
+  // The only frame is free again, neither the page nor the pool is stuck.
+  auto& other = buffer_manager.fix_page(1, false);
+  buffer_manager.unfix_page(other, false);
+  std::remove("9");
+  auto& page = buffer_manager.fix_page(page_id, false);
+  buffer_manager.unfix_page(page, false);
+  std::remove("9");
+}
+
+TEST(BufferManagerTest, ReadErrorEndsWaitForFrame) {
+  buzzdb::BufferManager buffer_manager{1024, 1};
+  std::remove("9");
+  ASSERT_EQ(0, ::mkdir("9", 0755));
+  uint64_t page_id = uint64_t{9} << 48;
+  EXPECT_THROW(buffer_manager.fix_page_wait(page_id, false, std::chrono::seconds(1)), std::exception);
+  EXPECT_EQ(0u, buffer_manager.get_frame_waiters());
+  auto* other = buffer_manager.fix_page_wait(1, false, std::chrono::seconds(1));
+  ASSERT_NE(nullptr, other);
+  buffer_manager.unfix_page(*other, false);
+  EXPECT_EQ(0u, buffer_manager.get_frame_waiters());
+  std::remove("9");
+}
+
+TEST(BufferManagerTest, WriteBackErrorKeepsVictim) {
+  buzzdb::BufferManager buffer_manager{1024, 1};
+  std::remove("9");
+  // Writes past 64 KiB fail with EFBIG while the limit is set, the page is
+  // behind it. The limit is set first, so no write back can happen before.
+  struct rlimit old_limit;
+  ASSERT_EQ(0, ::getrlimit(RLIMIT_FSIZE, &old_limit));
+  auto old_handler = std::signal(SIGXFSZ, SIG_IGN);
+  struct rlimit limit = old_limit;
+  limit.rlim_cur = 64 << 10;
+  ASSERT_EQ(0, ::setrlimit(RLIMIT_FSIZE, &limit));
+  uint64_t page_id = (uint64_t{9} << 48) | 1000;
+  {
+    auto& page = buffer_manager.fix_page(page_id, true);
+    std::memset(page.get_data(), 7, 1024);
+    buffer_manager.unfix_page(page, true);
+  }
+  EXPECT_THROW(buffer_manager.fix_page(1, false), std::exception);
+  ::setrlimit(RLIMIT_FSIZE, &old_limit);
+  std::signal(SIGXFSZ, old_handler);
+  // The victim is still dirty and unfixed, the next miss writes it back.
+  {
+    auto& page = buffer_manager.fix_page(1, false);
+    buffer_manager.unfix_page(page, false);
+  }
+  auto& page = buffer_manager.fix_page(page_id, false);
+  std::vector<char> expected(1024, 7);
+  EXPECT_EQ(0, std::memcmp(expected.data(), page.get_data(), 1024));
+  buffer_manager.unfix_page(page, false);
+  std::remove("9");
+}
+
 TEST(BufferManagerTest, FIFOEvict) {
   buzzdb::BufferManager buffer_manager{1024, 10};
   for (uint64_t i = 1; i < 11; ++i) {
@@ -107,6 +446,56 @@ TEST(BufferManagerTest, BufferFull) {
   }
 }
 
+TEST(BufferManagerTest, WaitForFrame) {
+  buzzdb::BufferManager buffer_manager{1024, 2};
+  auto& first = buffer_manager.fix_page(1, false);
+  auto& second = buffer_manager.fix_page(2, false);
+  EXPECT_EQ(nullptr, buffer_manager.fix_page_wait(3, false, std::chrono::milliseconds(10)));
+  // Page 2 is unfixed while the fix of page 3 waits for a frame.
+  std::thread unfixer([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    buffer_manager.unfix_page(second, true);
+  });
+  auto* third = buffer_manager.fix_page_wait(3, true, std::chrono::seconds(10));
+  unfixer.join();
+  ASSERT_NE(nullptr, third);
+  buffer_manager.unfix_page(*third, false);
+  buffer_manager.unfix_page(first, false);
+}
+
+TEST(BufferManagerTest, Stats) {
+  buzzdb::BufferManager buffer_manager{1024, 10};
+  for (uint64_t i = 1; i < 11; ++i) {
+    auto& page = buffer_manager.fix_page(i, false);
+    buffer_manager.unfix_page(page, false);
+  }
+  auto& page = buffer_manager.fix_page(1, false);
+  buffer_manager.unfix_page(page, false);
+  auto& evicting_page = buffer_manager.fix_page(11, false);
+  buffer_manager.unfix_page(evicting_page, false);
+  auto stats = buffer_manager.get_stats();
+  EXPECT_EQ(1, stats.hits);
+  EXPECT_EQ(11, stats.misses);
+  EXPECT_EQ(1, stats.promotions);
+  EXPECT_EQ(1, stats.evictions);
+  EXPECT_EQ(0, stats.full);
+  uint64_t reads = 0;
+  for (uint64_t count : stats.read_latency) reads += count;
+  EXPECT_EQ(11, reads);
+  EXPECT_GT(buzzdb::BufferStats::latency_percentile(stats.read_latency, 0.99), 0);
+  std::ostringstream out;
+  buffer_manager.set_stats_dump(&out, std::chrono::milliseconds(1));
+  // The cleaner thread prints under the lock of set_stats_dump, out is only
+  // read while the dump is off.
+  EXPECT_TRUE(Eventually([&] {
+    buffer_manager.set_stats_dump(nullptr, std::chrono::milliseconds(0));
+    if (out.str().find("hits 1 misses 11") != std::string::npos) return true;
+    buffer_manager.set_stats_dump(&out, std::chrono::milliseconds(1));
+    return false;
+  }));
+  buffer_manager.set_stats_dump(nullptr, std::chrono::milliseconds(0));
+}
+
 TEST(BufferManagerTest, MoveToLRU) {
   buzzdb::BufferManager buffer_manager{1024, 10};
   auto& fifo_page = buffer_manager.fix_page(1, false);
@@ -139,6 +528,50 @@ TEST(BufferManagerTest, LRURefresh) {
   EXPECT_EQ((std::vector<uint64_t>{2, 1}), buffer_manager.get_lru_list());
 }
 
+TEST(BufferManagerTest, ReplacementPolicies) {
+  for (auto type : {buzzdb::TWO_QUEUE, buzzdb::CLOCK, buzzdb::LRU_K, buzzdb::ARC}) {
+    // Pages 0 and 1 are fixed twice, pages 2 and 3 once; the pages seen
+    // once leave first, a fixed page is skipped.
+    auto make_policy = [type]() {
+      auto policy = buzzdb::ReplacementPolicy::make(type, 4);
+      for (uint32_t frame = 0; frame < 4; ++frame) {
+        policy->insert(frame, frame);
+      }
+      policy->access(0);
+      policy->access(1);
+      return policy;
+    };
+    auto take = [](uint32_t) { return buzzdb::TAKE; };
+    auto policy = make_policy();
+    EXPECT_EQ(2u, policy->victim(take)) << type;
+    EXPECT_EQ(3u, policy->victim(take)) << type;
+    policy = make_policy();
+    auto skip_2 = [](uint32_t frame) { return frame == 2 ? buzzdb::SKIP : buzzdb::TAKE; };
+    EXPECT_EQ(3u, policy->victim(skip_2)) << type;
+
+    buzzdb::BufferManager buffer_manager{1024, 10, false, false, type};
+    std::mt19937_64 engine{type};
+    std::uniform_int_distribution<uint64_t> page_distr{0, 29};
+    std::vector<uint64_t> values(30, 0);
+    for (uint64_t segment_page = 0; segment_page < 30; ++segment_page) {
+      auto& page = buffer_manager.fix_page((uint64_t{3} << 48) | segment_page, true);
+      *reinterpret_cast<uint64_t*>(page.get_data()) = 0;
+      buffer_manager.unfix_page(page, true);
+    }
+    for (int i = 0; i < 1000; ++i) {
+      uint64_t page_id = (uint64_t{3} << 48) | page_distr(engine);
+      bool write = i % 3 == 0;
+      auto& page = buffer_manager.fix_page(page_id, write);
+      uint64_t& value = *reinterpret_cast<uint64_t*>(page.get_data());
+      EXPECT_EQ(values[page_id & 31], value);
+      if (write) {
+        value = values[page_id & 31] = i;
+      }
+      buffer_manager.unfix_page(page, write);
+    }
+  }
+}
+
 TEST(BufferManagerTest, MultithreadParallelFix) {
   buzzdb::BufferManager buffer_manager{1024, 10};
   std::vector<std::thread> threads;
@@ -191,6 +624,45 @@ TEST(BufferManagerTest, MultithreadExclusiveAccess) {
   EXPECT_EQ(4000, value);
 }
 
+TEST(BufferManagerTest, MultithreadSharedAndOptimistic) {
+  buzzdb::BufferManager buffer_manager{1024, 10};
+  {
+    auto& page = buffer_manager.fix_page(0, true);
+    std::memset(page.get_data(), 0, 1024);
+    buffer_manager.unfix_page(page, true);
+  }
+  // Readers hold the page together, the writer waits for all of them.
+  auto& reader = buffer_manager.fix_page(0, false);
+  std::thread other_reader([&buffer_manager] {
+    auto& page = buffer_manager.fix_page(0, false);
+    buffer_manager.unfix_page(page, false);
+  });
+  other_reader.join();
+  std::atomic<bool> written = false;
+  std::thread writer([&buffer_manager, &written] {
+    auto& page = buffer_manager.fix_page(0, true);
+    ++*reinterpret_cast<uint64_t*>(page.get_data());
+    written = true;
+    buffer_manager.unfix_page(page, true);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_FALSE(written.load());
+  buffer_manager.unfix_page(reader, false);
+  writer.join();
+  EXPECT_TRUE(written.load());
+  // An optimistic read is valid unless a writer latched the page meanwhile.
+  uint64_t version;
+  auto& page = buffer_manager.fix_page_optimistic(0, version);
+  EXPECT_EQ(1, *reinterpret_cast<uint64_t*>(page.get_data()));
+  EXPECT_TRUE(buffer_manager.unfix_page_optimistic(page, version));
+  auto& stale = buffer_manager.fix_page_optimistic(0, version);
+  std::thread([&buffer_manager] {
+    auto& page = buffer_manager.fix_page(0, true);
+    buffer_manager.unfix_page(page, true);
+  }).join();
+  EXPECT_FALSE(buffer_manager.unfix_page_optimistic(stale, version));
+}
+
 TEST(BufferManagerTest, MultithreadBufferFull) {
   buzzdb::BufferManager buffer_manager{1024, 10};
   std::atomic<uint64_t> num_buffer_full = 0;
@@ -28,12 +28,41 @@ BufferFrame& BufferManager::fix_page(uint64_t page_id, bool /*exclusive*/) {
     auto& page = result.first->second;
     bool is_new = result.second;
     if (is_new) {
+        page.page_id = page_id;
         page.data.resize(page_size, 0);
     }
     return page;
 }
 
 
+BufferFrame& BufferManager::fix_slot(uint64_t& slot, bool exclusive) {
+    if (is_swizzled(slot)) {
+        return *reinterpret_cast<BufferFrame*>(slot & ~kSwizzledBit);
+    }
+    auto& page = fix_page(slot, exclusive);
+    // Only one slot may point to a frame, it is the one that is unswizzled.
+    if (page.swizzled_in) return page;
+    page.swizzled_in = &slot;
+    slot = reinterpret_cast<uint64_t>(&page) | kSwizzledBit;
+    return page;
+}
+
+
+void BufferManager::unswizzle_slot(uint64_t& slot) {
+    if (!is_swizzled(slot)) return;
+    auto* page = reinterpret_cast<BufferFrame*>(slot & ~kSwizzledBit);
+    page->swizzled_in = nullptr;
+    slot = page->page_id;
+}
+
+
+void BufferManager::unswizzle_page(uint64_t page_id) {
+    auto it = pages.find(page_id);
+    if (it == pages.end() || !it->second.swizzled_in) return;
+    unswizzle_slot(*it->second.swizzled_in);
+}
+
+
 void BufferManager::unfix_page(BufferFrame& /*page*/, bool /*is_dirty*/) {
 }
 
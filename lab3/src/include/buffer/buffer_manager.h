@@ -13,11 +13,18 @@ class BufferFrame {
 private:
     friend class BufferManager;
 
+    uint64_t page_id = 0;
+    /// The slot that holds a swizzled reference to this frame, nullptr if
+    /// the page is only referred to by its page id.
+    uint64_t* swizzled_in = nullptr;
     std::vector<char> data;
 
 public:
     /// Returns a pointer to this page's data.
     char* get_data();
+
+    /// Returns the page id of this page.
+    uint64_t get_page_id() const { return page_id; }
 };
 
 
@@ -66,6 +73,37 @@ public:
     /// written back to disk eventually.
     void unfix_page(BufferFrame& page, bool is_dirty);
 
+    /// A slot of a page that refers to another page, like the children of an
+    /// inner node, holds the page id or, when the page is swizzled, a pointer
+    /// to the frame of the page with this bit set. So only pages of segments
+    /// below 2^15 can be referred to by slots.
+    static constexpr uint64_t kSwizzledBit = 1ull << 63;
+
+    /// Returns true if `slot` holds a pointer to a frame.
+    static constexpr bool is_swizzled(uint64_t slot) {
+        return (slot & kSwizzledBit) != 0;
+    }
+
+    /// Returns the page id `slot` refers to, swizzled or not.
+    static uint64_t get_slot_page_id(uint64_t slot) {
+        return is_swizzled(slot) ? reinterpret_cast<BufferFrame*>(slot & ~kSwizzledBit)->page_id : slot;
+    }
+
+    /// Fixes the page `slot` refers to like `fix_page()`. A swizzled slot is
+    /// followed without a lookup of the page id, a slot with a page id is
+    /// swizzled once its page is fixed. The page that holds `slot` must stay
+    /// in the buffer while the slot is swizzled.
+    BufferFrame& fix_slot(uint64_t& slot, bool exclusive);
+
+    /// Writes the page id back into `slot` if it is swizzled. Slots have to
+    /// be unswizzled before they are moved to another place.
+    void unswizzle_slot(uint64_t& slot);
+
+    /// Unswizzles the slot that refers to a page, a page has to be
+    /// unswizzled before it leaves the buffer. This buffer manager keeps all
+    /// pages, so it does not evict them.
+    void unswizzle_page(uint64_t page_id);
+
     /// Returns the page ids of all pages (fixed and unfixed) that are in the
     /// FIFO list in FIFO order.
     /// Is not thread-safe.
@@ -12,6 +12,7 @@
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <stdexcept>
 
 #include "buffer/buffer_manager.h"
 #include "common/defer.h"
@@ -254,16 +255,30 @@ struct BTree : public Segment {
     /// Just increment the next_page_id whenever you need a new page.
     uint64_t next_page_id;
 
+    /// Follow the children of inner nodes through pointers to their frames
+    /// once they were fixed, instead of looking up their page ids.
+    bool swizzling;
+
     /// Constructor.
-    BTree(uint16_t segment_id, BufferManager &buffer_manager)
-        : Segment(segment_id, buffer_manager) {
-        // TODO
+    /// @param[in] swizzling    Swizzle the children of inner nodes, the segment id must be below 2^15.
+    /// Throws `std::invalid_argument` when swizzling with a larger segment id,
+    /// its page ids would have the swizzled bit set.
+    BTree(uint16_t segment_id, BufferManager &buffer_manager, bool swizzling = false)
+        : Segment(segment_id, buffer_manager), swizzling(swizzling) {
+        if(swizzling && BufferManager::is_swizzled(BufferManager::get_overall_page_id(segment_id, 0))){
+            throw std::invalid_argument("swizzling needs a segment id below 2^15");
+        }
         next_page_id = 1;
     }
 
+    /// Fix the child a slot of an inner node refers to.
+    BufferFrame& fix_child(uint64_t &slot){
+        if(swizzling) return buffer_manager.fix_slot(slot, true);
+        return buffer_manager.fix_page(slot, true);
+    }
+
     /// recursive function for lookup. Start from root node and recursively find the leaf node of given key.
-    std::optional<ValueT> recur_lookup(const KeyT &key, uint64_t page_id){
-        BufferFrame &current_frame = buffer_manager.fix_page(page_id , true);
+    std::optional<ValueT> recur_lookup(const KeyT &key, BufferFrame &current_frame){
         Node* current_node = reinterpret_cast<BTree::Node*>(current_frame.get_data());
         if(current_node->is_leaf()){    // already find the leaf node of key.                     
             LeafNode* leaf_node = static_cast<BTree::LeafNode*>(current_node);
@@ -289,19 +304,18 @@ struct BTree : public Segment {
             if(inner_node->keys[mid] <= key)  l = mid;//小于key
             else r = mid;// 大于key
         }
-        return recur_lookup(key, inner_node->children[r]);
+        return recur_lookup(key, fix_child(inner_node->children[r]));
     }
 
     /// Lookup an entry in the tree.
     /// @param[in] key      The key that should be searched.
     std::optional<ValueT> lookup(const KeyT &key) {
         if (!root.has_value()) return {};
-        return recur_lookup(key, root.value());
+        return recur_lookup(key, buffer_manager.fix_page(root.value(), true));
     }
 
     // recursive function for erase. Start from root node and recursively find the leaf node of given key and delete key_value.
-    void erase_recur(const KeyT &key ,uint64_t page_id){
-        BufferFrame &current_frame = buffer_manager.fix_page(page_id , true);
+    void erase_recur(const KeyT &key ,BufferFrame &current_frame){
         Node* current_node = reinterpret_cast<BTree::Node*>(current_frame.get_data());
         if(current_node->is_leaf()){
             // cast to leafnode
@@ -318,7 +332,7 @@ struct BTree : public Segment {
             if(inner_node->keys[mid] <= key)  l = mid;//小于key
             else r = mid;// 大于等于key
         }
-        erase_recur(key, inner_node->children[r]);
+        erase_recur(key, fix_child(inner_node->children[r]));
         return;
     }
 
@@ -329,13 +343,12 @@ struct BTree : public Segment {
 	      // the tree is empty
 	      return;
 	    }
-        erase_recur(key, root.value());
+        erase_recur(key, buffer_manager.fix_page(root.value(), true));
     }
     /// recursive function for insert. Start from root node and recursively find the leaf node to insert key_value. 
     /// Call leaf_node->insert(key_value); 
     /// If split, can return back from leaf_node call inner_node->insert(key_children);
-    ifsplit insert_recur(const KeyT &key, const ValueT &value,uint64_t page_id){
-        BufferFrame &current_frame = buffer_manager.fix_page(page_id , true);
+    ifsplit insert_recur(const KeyT &key, const ValueT &value,BufferFrame &current_frame){
         Node* current_node = reinterpret_cast<BTree::Node*>(current_frame.get_data());
         if(current_node->is_leaf()){
             LeafNode* leaf_node = static_cast<BTree::LeafNode*>(current_node);
@@ -350,7 +363,7 @@ struct BTree : public Segment {
             if(inner_node->keys[mid] <= key)  l = mid;//小于key
             else r = mid;// 大于key
         }
-        ifsplit split_info = insert_recur(key, value, inner_node->children[r]);
+        ifsplit split_info = insert_recur(key, value, fix_child(inner_node->children[r]));
         if(split_info.split){
             // need insert split into inner node
             // Insert key-children into inner node!
@@ -364,6 +377,12 @@ struct BTree : public Segment {
 
     /// General insert into a inner_node
     ifsplit innernode_insert(const KeyT &key,uint64_t child_page_id, InnerNode* inner_node){ 
+        // insert and split move the children, a frame only knows the slot it was swizzled in
+        if(swizzling){
+            for(uint16_t i=0;i<inner_node->count;i++){
+                buffer_manager.unswizzle_slot(inner_node->children[i]);
+            }
+        }
         //root is innernode
         if(inner_node->count < inner_node->kCapacity){
             inner_node->insert(key, child_page_id);
@@ -434,7 +453,7 @@ struct BTree : public Segment {
 	      return;
 	    }
         // Have root node, insert into tree.
-        ifsplit result = insert_recur(key,value, root.value());
+        ifsplit result = insert_recur(key,value, buffer_manager.fix_page(root.value(), true));
         if(result.split){
             // create a new root node;
             uint64_t new_root_page_id= buffer_manager.get_overall_page_id(segment_id, next_page_id);
@@ -484,12 +503,12 @@ struct BTree : public Segment {
             cout<<endl;
             cout<< "Children:";
             for(uint16_t i=0;i<inner_node->count;i++){
-                cout<< inner_node->children[i]<<"  ";
+                cout<< BufferManager::get_slot_page_id(inner_node->children[i])<<"  ";
             }
             cout<<endl;
             cout<<endl;
             for(uint16_t i=0;i<inner_node->count;i++){
-                node_info(inner_node->children[i]);
+                node_info(BufferManager::get_slot_page_id(inner_node->children[i]));
             }
             return;
     }
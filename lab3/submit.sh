@@ -20,7 +20,7 @@ fi
 
 if [ $# -eq 1 ]
 then
-	zip "${1}.zip" src/include/index/btree.h REPORT.md
+	zip "${1}.zip" src/include/index/btree.h src/include/buffer/buffer_manager.h src/buffer/buffer_manager.cc REPORT.md
 else
 	echo 'Please provide a file name, eg ./submit Gaurav'
 fi
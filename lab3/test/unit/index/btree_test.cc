@@ -4,6 +4,7 @@
 #include <numeric>
 #include <random>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 #include <thread>
 
@@ -274,6 +275,56 @@ TEST(BTreeTest, LookupRandomRepeating) {
   }
 }
 
+TEST(BTreeTest, SwizzlingNeedsSmallSegmentId) {
+  BufferManager buffer_manager(1024, 100);
+  EXPECT_THROW(BTree(1u << 15, buffer_manager, true), std::invalid_argument);
+  BTree tree((1u << 15) - 1, buffer_manager, true);
+  BTree unswizzled(1u << 15, buffer_manager);
+}
+
+TEST(BTreeTest, LookupSwizzled) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager, true);
+  auto n = 40 * BTree::LeafNode::kCapacity;
+
+  // Random keys split inner nodes whose children are swizzled
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), n);
+  std::mt19937_64 engine(0);
+  std::shuffle(keys.begin(), keys.end(), engine);
+  for (auto i = 0ul; i < n; ++i) {
+    tree.insert(keys[i], 2 * keys[i]);
+    ASSERT_TRUE(tree.lookup(keys[i]))
+        << "searching for the just inserted key k=" << keys[i]
+        << " after i=" << i << " inserts yields nothing";
+  }
+  for (auto i = 0ul; i < n; ++i) {
+    auto v = tree.lookup(keys[i]);
+    ASSERT_TRUE(v) << "key=" << keys[i] << " is missing";
+    ASSERT_EQ(*v, 2 * keys[i]);
+  }
+
+  // All children of the root were used, so they are swizzled
+  auto& root_page = buffer_manager.fix_page(*tree.root, false);
+  auto root_node = reinterpret_cast<BTree::InnerNode*>(root_page.get_data());
+  Defer root_page_unfix([&]() { buffer_manager.unfix_page(root_page, false); });
+  ASSERT_FALSE(root_node->is_leaf());
+  for (auto i = 0; i < root_node->count; ++i) {
+    ASSERT_TRUE(BufferManager::is_swizzled(root_node->children[i]));
+  }
+
+  // An unswizzled child is found by its page id and swizzled again
+  auto child_page_id = BufferManager::get_slot_page_id(root_node->children[0]);
+  buffer_manager.unswizzle_page(child_page_id);
+  ASSERT_EQ(root_node->children[0], child_page_id);
+  for (auto i = 0ul; i < n; ++i) {
+    auto v = tree.lookup(keys[i]);
+    ASSERT_TRUE(v) << "key=" << keys[i] << " is missing";
+    ASSERT_EQ(*v, 2 * keys[i]);
+  }
+  ASSERT_TRUE(BufferManager::is_swizzled(root_node->children[0]));
+}
+
 TEST(BTreeTest, Erase) {
   BufferManager buffer_manager(1024, 100);
   BTree tree(0, buffer_manager);